@@ -21,14 +21,26 @@ SOURCES += \
     src/main.cpp \
     src/Editor.cpp \
     src/Image.cpp \
+    src/History.cpp \
+    src/Compress.cpp \
     src/ImageWidget.cpp \
-    src/Bitmap.cpp
+    src/Bitmap.cpp \
+    src/Blend.cpp \
+    src/Brush.cpp \
+    src/Parallel.cpp \
+    src/Compositor.cpp
 
 HEADERS += \
     src/Editor.h \
     src/Image.h \
+    src/History.h \
+    src/Compress.h \
     src/ImageWidget.h \
     src/Bitmap.h \
+    src/Blend.h \
+    src/Brush.h \
+    src/Parallel.h \
+    src/Compositor.h \
     src/common.h
 
 
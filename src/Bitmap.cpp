@@ -1,248 +1,1756 @@
 #include "Bitmap.h"
+#include "Blend.h"
 #include "common.h"
+#include "Parallel.h"
 
+#include <cstdint>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 
-struct Point {
-    int x;
-    int y;
-};
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-struct PointQueue {
-    int size;
-    int capacity;
-    int start;
-    int end;
-    Point *data;
-};
+bool color_eq(Color c1, Color c2) {
+    return (c1.r == c2.r && c1.g == c2.g && c1.b == c2.b && c1.a == c2.a);
+}
 
-PointQueue pq_create() {
-    return PointQueue {
-        0,
-        1024,
-        0,
-        0,
-        (Point*)malloc(sizeof(Point) * 1024),
+Color color_premultiply(Color color) {
+    return Color {
+        (unsigned char)((color.r * color.a + 127) / 255),
+        (unsigned char)((color.g * color.a + 127) / 255),
+        (unsigned char)((color.b * color.a + 127) / 255),
+        color.a,
     };
 }
 
-void pq_free(PointQueue *q) {
-    free(q->data);
+Color color_unpremultiply(Color color) {
+    if (color.a == 0) {
+        return Color { 0, 0, 0, 0 };
+    }
+    return Color {
+        (unsigned char)MIN(255, (color.r * 255 + color.a / 2) / color.a),
+        (unsigned char)MIN(255, (color.g * 255 + color.a / 2) / color.a),
+        (unsigned char)MIN(255, (color.b * 255 + color.a / 2) / color.a),
+        color.a,
+    };
+}
+
+// Set when memory needed while drawing couldn't be allocated. Tiles are
+// allocated deep inside parallel jobs, so the pixels that needed one are
+// skipped, and the failure is picked up afterwards with
+// bitmap_take_allocation_failure().
+static std::atomic<bool> allocation_failed;
+
+static void bitmap_allocation_failed(const char *what) {
+    if (!allocation_failed.exchange(true)) {
+        printf("Out of memory allocating %s\n", what);
+    }
 }
 
-void pq_push(PointQueue *q, Point p) {
-    if (q->end == q->capacity) {
-        int oldCapacity = q->capacity;
-        q->capacity *= 2;
-        Point *newData = (Point*)malloc(sizeof(Point) * q->capacity);
-        for (int i = 0; i < oldCapacity; i++) {
-            newData[i] = q->data[i];
+// Returns whether an allocation made while drawing failed since the last call
+bool bitmap_take_allocation_failure() {
+    return allocation_failed.exchange(false);
+}
+
+// Creates a transparent tile with a single owner, or returns NULL when out of
+// memory
+Tile *tile_create() {
+    Tile *tile = (Tile*)calloc(1, sizeof(Tile));
+    if (tile == NULL) {
+        bitmap_allocation_failed("a tile");
+        return NULL;
+    }
+    tile->refcount = 1;
+    return tile;
+}
+
+void tile_retain(Tile *tile) {
+    if (tile != NULL) {
+        tile->refcount += 1;
+    }
+}
+
+void tile_release(Tile *tile) {
+    if (tile != NULL) {
+        if (--tile->refcount == 0) {
+            free(tile);
         }
-        free(q->data);
-        q->data = newData;
     }
-    q->data[q->end] = p;
-    q->size += 1;
-    q->end += 1;
 }
 
-bool pq_pop(PointQueue *q, Point *p) {
-    if (q->size <= 0) {
-        return false;
+static void bitmap_replace_tile(Bitmap *bitmap, int index, Tile *tile) {
+    tile_retain(tile);
+    tile_release(bitmap->tiles[index]);
+    bitmap->tiles[index] = tile;
+}
+
+static Rect bitmap_tile_rect(Bitmap *bitmap, int index) {
+    Rect r = { (index % bitmap->tiles_x) * TILE_SIZE, (index / bitmap->tiles_x) * TILE_SIZE, TILE_SIZE, TILE_SIZE };
+    return rect_intersect(r, Rect { 0, 0, bitmap->width, bitmap->height });
+}
+
+// Replaces one tile of a tiled bitmap, sharing the new tile with its other owners
+void bitmap_set_tile(Bitmap *bitmap, int index, Tile *tile) {
+    bitmap_replace_tile(bitmap, index, tile);
+    if (tile != NULL) {
+        bitmap->content = rect_union(bitmap->content, bitmap_tile_rect(bitmap, index));
+    }
+}
+
+// Bounds the allocated tiles of a tiled bitmap
+static Rect bitmap_tile_bounds(Bitmap *bitmap) {
+    Rect bounds = { 0, 0, 0, 0 };
+    for (int i = 0; i < bitmap->tiles_x * bitmap->tiles_y; i++) {
+        if (bitmap->tiles[i] != NULL) {
+            bounds = rect_union(bounds, bitmap_tile_rect(bitmap, i));
+        }
+    }
+    return bounds;
+}
+
+bool rect_is_empty(Rect r) {
+    return r.width <= 0 || r.height <= 0;
+}
+
+Rect rect_union(Rect a, Rect b) {
+    if (rect_is_empty(a)) {
+        return b;
+    }
+    if (rect_is_empty(b)) {
+        return a;
+    }
+    int x1 = MIN(a.x, b.x);
+    int y1 = MIN(a.y, b.y);
+    int x2 = MAX(a.x + a.width, b.x + b.width);
+    int y2 = MAX(a.y + a.height, b.y + b.height);
+    return Rect { x1, y1, x2 - x1, y2 - y1 };
+}
+
+Rect rect_intersect(Rect a, Rect b) {
+    int x1 = MAX(a.x, b.x);
+    int y1 = MAX(a.y, b.y);
+    int x2 = MIN(a.x + a.width, b.x + b.width);
+    int y2 = MIN(a.y + a.height, b.y + b.height);
+    if (x1 >= x2 || y1 >= y2) {
+        return Rect { 0, 0, 0, 0 };
+    }
+    return Rect { x1, y1, x2 - x1, y2 - y1 };
+}
+
+Rect rect_offset(Rect r, int dx, int dy) {
+    return Rect { r.x + dx, r.y + dy, r.width, r.height };
+}
+
+// Smallest rectangle covering `r` once everything is scaled down by 2^shift
+Rect rect_downscale(Rect r, int shift) {
+    if (rect_is_empty(r)) {
+        return Rect { 0, 0, 0, 0 };
+    }
+    int x = r.x >> shift;
+    int y = r.y >> shift;
+    return Rect { x, y, ((r.x + r.width - 1) >> shift) - x + 1, ((r.y + r.height - 1) >> shift) - y + 1 };
+}
+
+static void bitmap_mark_dirty(Bitmap *bitmap, Rect r) {
+    bitmap->dirty = rect_union(bitmap->dirty, r);
+    bitmap->content = rect_union(bitmap->content, r);
+}
+
+// Returns the area drawn since the last call and starts tracking anew
+Rect bitmap_take_dirty(Bitmap *bitmap) {
+    Rect dirty = bitmap->dirty;
+    bitmap->dirty = Rect { 0, 0, 0, 0 };
+    return dirty;
+}
+
+// Returns the address of pixel (x, y), which must lie inside the bitmap. For
+// tiled bitmaps, if `write` is set the pixel's tile is allocated when missing
+// and made private when shared with another bitmap. Otherwise NULL is returned
+// when the tile doesn't exist (i.e. the pixel is transparent). Writes also get
+// NULL when the tile can't be allocated, and must then skip the pixels.
+static unsigned char *bitmap_pixel_address(Bitmap *bitmap, int x, int y, bool write) {
+    if (bitmap->storage == STORAGE_FLAT) {
+        return bitmap->data + ((size_t)y * bitmap->width + x) * 4;
+    }
+    Tile **tile = &bitmap->tiles[(y >> TILE_SHIFT) * bitmap->tiles_x + (x >> TILE_SHIFT)];
+    if (*tile == NULL) {
+        if (!write) {
+            return NULL;
+        }
+        *tile = tile_create();
+        if (*tile == NULL) {
+            return NULL;
+        }
+    } else if (write && (*tile)->refcount > 1) {
+        Tile *copy = tile_create();
+        if (copy == NULL) {
+            return NULL;
+        }
+        memcpy(copy->data, (*tile)->data, TILE_BYTES);
+        tile_release(*tile);
+        *tile = copy;
+    }
+    return (*tile)->data + (((y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK)) * 4;
+}
+
+// Returns how many pixels starting at (x, y) are stored contiguously
+static int bitmap_span_length(Bitmap *bitmap, int x) {
+    if (bitmap->storage == STORAGE_FLAT) {
+        return bitmap->width - x;
+    }
+    return MIN(TILE_SIZE - (x & TILE_MASK), bitmap->width - x);
+}
+
+// Parallel operations split their rectangle into the rows of tiles it
+// spans, so every job writes to tiles no other job touches
+static int rect_tile_rows(Rect r) {
+    return ((r.y + r.height - 1) >> TILE_SHIFT) - (r.y >> TILE_SHIFT) + 1;
+}
+
+static Rect rect_tile_row(Rect r, int index) {
+    int y1 = MAX(r.y, ((r.y >> TILE_SHIFT) + index) << TILE_SHIFT);
+    int y2 = MIN(r.y + r.height, ((r.y >> TILE_SHIFT) + index + 1) << TILE_SHIFT);
+    return Rect { r.x, y1, r.width, y2 - y1 };
+}
+
+static inline unsigned load_pixel(const unsigned char *p) {
+    unsigned v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// Packs a straight colour the way the bitmap stores it
+static unsigned bitmap_pack_color(Bitmap *bitmap, Color color) {
+    if (bitmap->format == PIXEL_PREMULTIPLIED) {
+        color = color_premultiply(color);
+    }
+    return load_pixel((const unsigned char*)&color);
+}
+
+// Returns the address of pixel (x, y) for storing `value`. Unallocated tiles
+// already hold transparent black, so they aren't allocated just to store it.
+static unsigned char *bitmap_store_address(Bitmap *bitmap, int x, int y, unsigned value) {
+    if (value == 0 && bitmap_pixel_address(bitmap, x, y, false) == NULL) {
+        return NULL;
+    }
+    return bitmap_pixel_address(bitmap, x, y, true);
+}
+
+// Writes `count` copies of a packed pixel, two per 64-bit store
+static void fill_pixels(unsigned char *p, unsigned value, int count) {
+    if (value == 0) {
+        memset(p, 0, count * 4);
+        return;
+    }
+    unsigned long long pair = value | (unsigned long long)value << 32;
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        memcpy(p + i * 4, &pair, 8);
+    }
+    if (i < count) {
+        memcpy(p + i * 4, &value, 4);
+    }
+}
+
+// Creates a tile filled with a packed colour, to be shared by every tile a
+// fill covers completely
+static Tile *tile_create_solid(unsigned value) {
+    Tile *tile = tile_create();
+    if (tile == NULL) {
+        return NULL;
+    }
+    fill_pixels(tile->data, value, TILE_SIZE * TILE_SIZE);
+    return tile;
+}
+
+// Whether `count` pixels are all zero, which is transparent in either format
+static bool pixels_are_empty(const unsigned char *p, int count) {
+    static const unsigned char transparent[TILE_SIZE * 4] = {};
+    for (int i = 0; i < count; i += TILE_SIZE) {
+        if (memcmp(p + i * 4, transparent, MIN(count - i, TILE_SIZE) * 4) != 0) {
+            return false;
+        }
     }
-    *p = q->data[q->start];
-    q->start += 1;
-    q->size -= 1;
     return true;
 }
 
-bool color_eq(Color c1, Color c2) {
-    return (c1.r == c2.r && c1.g == c2.g && c1.b == c2.b && c1.a == c2.a);
+// Copies a block of pixels already in the bitmap's format without marking
+// it dirty. Transparent runs don't allocate tiles that are still missing.
+static void bitmap_store_block(Bitmap *bitmap, int x, int y, int width, int height, const unsigned char *src, int stride) {
+    for (int row = 0; row < height; row++) {
+        const unsigned char *s = src + row * stride;
+        int dx = x;
+        int remaining = width;
+        while (remaining > 0) {
+            int count = MIN(remaining, bitmap_span_length(bitmap, dx));
+            bool empty = bitmap->storage == STORAGE_TILED && pixels_are_empty(s, count);
+            if (!empty || bitmap_pixel_address(bitmap, dx, y + row, false) != NULL) {
+                unsigned char *p = bitmap_pixel_address(bitmap, dx, y + row, true);
+                if (p != NULL) {
+                    memcpy(p, s, count * 4);
+                }
+            }
+            s += count * 4;
+            dx += count;
+            remaining -= count;
+        }
+    }
+}
+
+// Sets pixels [x1, x2] of row y, which must lie inside the bitmap, to a
+// packed colour
+static void bitmap_set_span(Bitmap *bitmap, int x1, int x2, int y, unsigned value) {
+    int x = x1;
+    while (x <= x2) {
+        int count = MIN(x2 - x + 1, bitmap_span_length(bitmap, x));
+        unsigned char *p = bitmap_store_address(bitmap, x, y, value);
+        if (p != NULL) {
+            fill_pixels(p, value, count);
+        }
+        x += count;
+    }
+}
+
+struct SetRectJob {
+    Bitmap *bitmap;
+    Rect rect;
+    unsigned value;
+    Tile *solid; // Shared by the tiles the rectangle covers completely, NULL when clearing
+};
+
+// Whether every pixel of the tile outside columns [x1, x2) of rows [y1, y2),
+// in the tile's own coordinates, is transparent
+static bool tile_is_empty_outside(Tile *tile, int x1, int y1, int x2, int y2) {
+    for (int y = 0; y < TILE_SIZE; y++) {
+        const unsigned char *row = tile->data + y * TILE_SIZE * 4;
+        if (y < y1 || y >= y2) {
+            if (!pixels_are_empty(row, TILE_SIZE)) {
+                return false;
+            }
+        } else if (!pixels_are_empty(row, x1) || !pixels_are_empty(row + x2 * 4, TILE_SIZE - x2)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void bitmap_set_rect_row(int index, void *data) {
+    SetRectJob *job = (SetRectJob*)data;
+    Bitmap *bitmap = job->bitmap;
+    Rect r = rect_tile_row(job->rect, index);
+    int right = r.x + r.width;
+    if (bitmap->storage == STORAGE_FLAT) {
+        for (int y = r.y; y < r.y + r.height; y++) {
+            bitmap_set_span(bitmap, r.x, right - 1, y, job->value);
+        }
+        return;
+    }
+    int ty = r.y >> TILE_SHIFT;
+    for (int tx = r.x >> TILE_SHIFT; tx <= (right - 1) >> TILE_SHIFT; tx++) {
+        int x1 = MAX(r.x, tx << TILE_SHIFT);
+        int x2 = MIN(right, (tx + 1) << TILE_SHIFT);
+        int index = ty * bitmap->tiles_x + tx;
+        Tile *tile = bitmap->tiles[index];
+        if (x2 - x1 == TILE_SIZE && r.height == TILE_SIZE && (job->solid != NULL || job->value == 0)) {
+            bitmap_replace_tile(bitmap, index, job->solid);
+        } else if (job->value == 0 && tile != NULL
+                && tile_is_empty_outside(tile, x1 & TILE_MASK, r.y & TILE_MASK, ((x2 - 1) & TILE_MASK) + 1, ((r.y + r.height - 1) & TILE_MASK) + 1)) {
+            // Nothing would be left after clearing part of the tile, so it
+            // is dropped rather than written, or copied when shared
+            bitmap_replace_tile(bitmap, index, NULL);
+        } else if (job->value != 0 || tile != NULL) {
+            for (int y = r.y; y < r.y + r.height; y++) {
+                bitmap_set_span(bitmap, x1, x2 - 1, y, job->value);
+            }
+        }
+    }
+}
+
+// Sets the part of `rect` inside the bitmap to a packed colour. Tiles it
+// covers completely are replaced by a shared solid tile, or dropped when
+// clearing, rather than written. Clearing also drops tiles it leaves empty.
+static void bitmap_set_rect(Bitmap *bitmap, Rect rect, unsigned value) {
+    // Clearing can't change anything outside the content
+    rect = rect_intersect(rect, value == 0 ? bitmap->content : Rect { 0, 0, bitmap->width, bitmap->height });
+    if (rect_is_empty(rect)) {
+        return;
+    }
+    SetRectJob job = { bitmap, rect, value, NULL };
+    if (bitmap->storage == STORAGE_TILED && value != 0) {
+        job.solid = tile_create_solid(value);
+    }
+    parallel_for(rect_tile_rows(rect), bitmap_set_rect_row, &job);
+    tile_release(job.solid);
+    bitmap_mark_dirty(bitmap, rect);
+}
+
+// Bytes of pixels in a width x height bitmap, or SIZE_MAX if that overflows
+static size_t bitmap_bytes(int width, int height) {
+    if (width <= 0 || height <= 0) {
+        return 0;
+    }
+    if ((size_t)width > SIZE_MAX / 4 / (size_t)height) {
+        return SIZE_MAX;
+    }
+    return (size_t)width * height * 4;
+}
+
+static Bitmap bitmap_create_failed(int width, int height, BitmapStorage storage) {
+    printf("Not enough memory for a %d x %d bitmap\n", width, height);
+    return storage == STORAGE_FLAT ? bitmap_create(0, 0) : bitmap_create_tiled(0, 0);
 }
 
 Bitmap bitmap_create(int width, int height) {
-    int size = width * height * 4;
-    unsigned char *data = (unsigned char*) malloc(sizeof(unsigned char) * size);
-    for (int i = 0; i < size; i++) {
-        data[i] = 0;
+    size_t size = bitmap_bytes(width, height);
+    unsigned char *data = NULL;
+    if (size > 0) {
+        data = (unsigned char*)(size == SIZE_MAX ? NULL : calloc(size, 1));
+        if (data == NULL) {
+            return bitmap_create_failed(width, height, STORAGE_FLAT);
+        }
     }
     return Bitmap {
         data,
         width,
         height,
         size,
+        STORAGE_FLAT,
+        PIXEL_STRAIGHT,
+        NULL,
+        0,
+        0,
+        Rect { 0, 0, 0, 0 },
+        Rect { 0, 0, width, height },
     };
 }
 
-Bitmap bitmap_create_rotated(Bitmap *old) {
-    Bitmap bitmap = bitmap_create(old->height, old->width);
-    for (int y = 0; y < old->height; y++) {
-        for (int x = 0; x < old->width; x++) {
-            int oldOffset = (y * old->width + x) * 4;
-            int offset = (  (old->height - 1 - y) +  (x * old->height)  ) * 4;
-            bitmap.data[offset] = old->data[oldOffset];
-            bitmap.data[offset + 1] = old->data[oldOffset + 1];
-            bitmap.data[offset + 2] = old->data[oldOffset + 2];
-            bitmap.data[offset + 3] = old->data[oldOffset + 3];
+Bitmap bitmap_create_tiled(int width, int height) {
+    size_t size = bitmap_bytes(width, height);
+    int tiles_x = width > 0 ? (int)(((size_t)width + TILE_SIZE - 1) / TILE_SIZE) : 0;
+    int tiles_y = height > 0 ? (int)(((size_t)height + TILE_SIZE - 1) / TILE_SIZE) : 0;
+    Tile **tiles = NULL;
+    if (size > 0) {
+        tiles = (Tile**)(size == SIZE_MAX ? NULL : calloc((size_t)tiles_x * tiles_y, sizeof(Tile*)));
+        if (tiles == NULL) {
+            return bitmap_create_failed(width, height, STORAGE_TILED);
         }
     }
+    return Bitmap {
+        NULL,
+        width,
+        height,
+        size,
+        STORAGE_TILED,
+        PIXEL_STRAIGHT,
+        tiles,
+        tiles_x,
+        tiles_y,
+        Rect { 0, 0, 0, 0 },
+        Rect { 0, 0, 0, 0 },
+    };
+}
+
+Bitmap bitmap_copy(Bitmap *original) {
+    Bitmap bitmap = *original;
+    bitmap.dirty = Rect { 0, 0, 0, 0 };
+    if (original->storage == STORAGE_FLAT) {
+        if (original->size == 0) {
+            return bitmap;
+        }
+        bitmap.data = (unsigned char*)malloc(original->size);
+        if (bitmap.data == NULL) {
+            return bitmap_create_failed(original->width, original->height, STORAGE_FLAT);
+        }
+        memcpy(bitmap.data, original->data, original->size);
+    } else {
+        // Tiles are shared until one of the bitmaps writes to them
+        return bitmap_copy_region(original, original->content);
+    }
     return bitmap;
 }
 
-Bitmap bitmap_create_flipped_horizontal(Bitmap *old) {
-    Bitmap bitmap = bitmap_create(old->width, old->height);
-    for (int y = 0; y < bitmap.height; y++) {
-        for (int x = 0; x < bitmap.width; x++) {
-            Color c;
-            if (bitmap_get_pixel(old, x, y, &c)) {
-                bitmap_draw_pixel(&bitmap, bitmap.width - 1 - x, y, c);
-            }
+// Copies the part of the bitmap inside `r`. Tiled copies only share the tiles
+// overlapping it and leave the rest unallocated, so snapshotting a small
+// region is cheap however large the bitmap is.
+Bitmap bitmap_copy_region(Bitmap *original, Rect r) {
+    if (original->storage == STORAGE_FLAT) {
+        return bitmap_copy(original);
+    }
+    Bitmap bitmap = *original;
+    bitmap.dirty = Rect { 0, 0, 0, 0 };
+    bitmap.tiles = NULL;
+    if (original->tiles_x > 0 && original->tiles_y > 0) {
+        bitmap.tiles = (Tile**)calloc((size_t)original->tiles_x * original->tiles_y, sizeof(Tile*));
+        if (bitmap.tiles == NULL) {
+            return bitmap_create_failed(original->width, original->height, STORAGE_TILED);
+        }
+    }
+    r = rect_intersect(r, original->content);
+    if (rect_is_empty(r)) {
+        bitmap.content = Rect { 0, 0, 0, 0 };
+        return bitmap;
+    }
+    bitmap.content = Rect { 0, 0, 0, 0 };
+    for (int ty = r.y >> TILE_SHIFT; ty <= (r.y + r.height - 1) >> TILE_SHIFT; ty++) {
+        for (int tx = r.x >> TILE_SHIFT; tx <= (r.x + r.width - 1) >> TILE_SHIFT; tx++) {
+            int index = ty * original->tiles_x + tx;
+            bitmap.tiles[index] = original->tiles[index];
+            tile_retain(bitmap.tiles[index]);
+            // Whole tiles are shared, so the copy's content covers them too
+            bitmap.content = rect_union(bitmap.content, bitmap_tile_rect(&bitmap, index));
         }
     }
+    bitmap.content = rect_intersect(bitmap.content, original->content);
     return bitmap;
 }
 
-Bitmap bitmap_create_flipped_vertical(Bitmap *old) {
-    Bitmap bitmap = bitmap_create(old->width, old->height);
-    for (int y = 0; y < bitmap.height; y++) {
-        for (int x = 0; x < bitmap.width; x++) {
-            Color c;
-            if (bitmap_get_pixel(old, x, y, &c)) {
-                bitmap_draw_pixel(&bitmap, x, bitmap.height - 1 - y, c);
+// Transforms work on one destination tile at a time. The source pixels it
+// comes from are gathered into a contiguous block, reordered there, and
+// written out, so the kernels below never see tile boundaries and every
+// block stays in cache.
+#define BLOCK_STRIDE (TILE_SIZE * 4)
+
+// Each transform is a combination of reversing the rows of the gathered
+// block, reversing the pixels within each row, and transposing it
+struct Transform {
+    bool rotate; // Swaps width and height
+    bool reverse_rows;
+    bool reverse_pixels;
+};
+
+static const Transform TRANSFORM_ROTATE_90 = { true, true, false };
+static const Transform TRANSFORM_ROTATE_180 = { false, true, true };
+static const Transform TRANSFORM_ROTATE_270 = { true, false, true };
+
+// Writes the `count` pixels of `src` to `dst` in reverse order
+static void reverse_pixels(const unsigned char *src, unsigned char *dst, int count) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + (count - 4 - i) * 4));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#endif
+    for (; i < count; i++) {
+        memcpy(dst + i * 4, src + (count - 1 - i) * 4, 4);
+    }
+}
+
+// Transposes a width x height block into a height x width one, 4x4 pixels
+// at a time where SSE2 is available
+static void transpose_block(const unsigned char *src, unsigned char *dst, int width, int height) {
+    int y = 0;
+#ifdef __SSE2__
+    for (; y + 4 <= height; y += 4) {
+        int x = 0;
+        for (; x + 4 <= width; x += 4) {
+            const unsigned char *s = src + y * BLOCK_STRIDE + x * 4;
+            __m128i r0 = _mm_loadu_si128((const __m128i*)s);
+            __m128i r1 = _mm_loadu_si128((const __m128i*)(s + BLOCK_STRIDE));
+            __m128i r2 = _mm_loadu_si128((const __m128i*)(s + BLOCK_STRIDE * 2));
+            __m128i r3 = _mm_loadu_si128((const __m128i*)(s + BLOCK_STRIDE * 3));
+            __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+            __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+            __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+            __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+            unsigned char *d = dst + x * BLOCK_STRIDE + y * 4;
+            _mm_storeu_si128((__m128i*)d, _mm_unpacklo_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*)(d + BLOCK_STRIDE), _mm_unpackhi_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*)(d + BLOCK_STRIDE * 2), _mm_unpacklo_epi64(t2, t3));
+            _mm_storeu_si128((__m128i*)(d + BLOCK_STRIDE * 3), _mm_unpackhi_epi64(t2, t3));
+        }
+        for (; x < width; x++) {
+            for (int i = y; i < y + 4; i++) {
+                memcpy(dst + x * BLOCK_STRIDE + i * 4, src + i * BLOCK_STRIDE + x * 4, 4);
+            }
+        }
+    }
+#endif
+    for (; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            memcpy(dst + x * BLOCK_STRIDE + y * 4, src + y * BLOCK_STRIDE + x * 4, 4);
+        }
+    }
+}
+
+// Copies the width x height block at (x, y) of the bitmap into `dst`, with
+// its rows in reverse order if asked. Returns false if it is all unallocated.
+static bool bitmap_gather_block(Bitmap *bitmap, int x, int y, int width, int height, bool reverse_rows, unsigned char *dst) {
+    bool allocated = false;
+    for (int row = 0; row < height; row++) {
+        unsigned char *d = dst + (reverse_rows ? height - 1 - row : row) * BLOCK_STRIDE;
+        int sx = x;
+        while (sx < x + width) {
+            int count = MIN(x + width - sx, bitmap_span_length(bitmap, sx));
+            const unsigned char *p = bitmap_pixel_address(bitmap, sx, y + row, false);
+            if (p != NULL) {
+                memcpy(d, p, count * 4);
+                allocated = true;
+            } else {
+                memset(d, 0, count * 4);
+            }
+            d += count * 4;
+            sx += count;
+        }
+    }
+    return allocated;
+}
+
+struct TransformJob {
+    Bitmap *old;
+    Bitmap *bitmap;
+    Transform transform;
+};
+
+// Transforms one row of destination tiles
+static void bitmap_transform_row(int index, void *data) {
+    TransformJob *job = (TransformJob*)data;
+    Bitmap *old = job->old;
+    Bitmap *bitmap = job->bitmap;
+    Transform t = job->transform;
+    unsigned char blocks[2][TILE_SIZE * BLOCK_STRIDE];
+
+    int y = index * TILE_SIZE;
+    int height = MIN(TILE_SIZE, bitmap->height - y);
+    for (int x = 0; x < bitmap->width; x += TILE_SIZE) {
+        int width = MIN(TILE_SIZE, bitmap->width - x);
+
+        // The source block, which is transposed if the transform rotates
+        int source_width = t.rotate ? height : width;
+        int source_height = t.rotate ? width : height;
+        int source_x = t.reverse_pixels ? old->width - (t.rotate ? y : x) - source_width : (t.rotate ? y : x);
+        int source_y = t.reverse_rows ? old->height - (t.rotate ? x : y) - source_height : (t.rotate ? x : y);
+
+        unsigned char *block = blocks[0];
+        if (!bitmap_gather_block(old, source_x, source_y, source_width, source_height, t.reverse_rows, block)) {
+            continue;
+        }
+        if (t.reverse_pixels) {
+            for (int row = 0; row < source_height; row++) {
+                reverse_pixels(block + row * BLOCK_STRIDE, blocks[1] + row * BLOCK_STRIDE, source_width);
             }
+            block = blocks[1];
         }
+        if (t.rotate) {
+            unsigned char *other = block == blocks[0] ? blocks[1] : blocks[0];
+            transpose_block(block, other, source_width, source_height);
+            block = other;
+        }
+        bitmap_store_block(bitmap, x, y, width, height, block, BLOCK_STRIDE);
+    }
+}
+
+static Bitmap bitmap_create_transformed(Bitmap *old, Transform transform) {
+    int width = transform.rotate ? old->height : old->width;
+    int height = transform.rotate ? old->width : old->height;
+    Bitmap bitmap = old->storage == STORAGE_FLAT ? bitmap_create(width, height) : bitmap_create_tiled(width, height);
+    bitmap.format = old->format;
+    if (bitmap.width != width) {
+        return bitmap;
+    }
+
+    // Every job writes its own destination tiles, and only reads the old bitmap
+    TransformJob job = { old, &bitmap, transform };
+    parallel_for((height + TILE_SIZE - 1) / TILE_SIZE, bitmap_transform_row, &job);
+    bitmap_mark_dirty(&bitmap, Rect { 0, 0, width, height });
+    if (bitmap.storage == STORAGE_TILED) {
+        bitmap.content = bitmap_tile_bounds(&bitmap);
     }
     return bitmap;
 }
 
+// Rotates clockwise by a multiple of 90 degrees
+Bitmap bitmap_create_rotated(Bitmap *old, int degrees) {
+    switch (((degrees % 360) + 360) % 360) {
+        case 90:
+            return bitmap_create_transformed(old, TRANSFORM_ROTATE_90);
+        case 180:
+            return bitmap_create_transformed(old, TRANSFORM_ROTATE_180);
+        case 270:
+            return bitmap_create_transformed(old, TRANSFORM_ROTATE_270);
+        default:
+            return bitmap_copy(old);
+    }
+}
+
+// Exchanges `count` pixels between `a` and `b`, reversing their order: the
+// first pixel of `a` swaps with the last of `b`. The two runs mustn't overlap.
+static void swap_pixels_reversed(unsigned char *a, unsigned char *b, int count) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4) {
+        unsigned char *pa = a + i * 4;
+        unsigned char *pb = b + (count - i - 4) * 4;
+        __m128i va = _mm_loadu_si128((const __m128i*)pa);
+        __m128i vb = _mm_loadu_si128((const __m128i*)pb);
+        _mm_storeu_si128((__m128i*)pa, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 1, 2, 3)));
+        _mm_storeu_si128((__m128i*)pb, _mm_shuffle_epi32(va, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#endif
+    for (; i < count; i++) {
+        unsigned v = load_pixel(a + i * 4);
+        memcpy(a + i * 4, b + (count - 1 - i) * 4, 4);
+        memcpy(b + (count - 1 - i) * 4, &v, 4);
+    }
+}
+
+// Exchanges `count` pixels between `a` and `b`
+static void swap_pixels(unsigned char *a, unsigned char *b, int count) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i * 4));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i * 4));
+        _mm_storeu_si128((__m128i*)(a + i * 4), vb);
+        _mm_storeu_si128((__m128i*)(b + i * 4), va);
+    }
+#endif
+    for (; i < count; i++) {
+        unsigned v = load_pixel(a + i * 4);
+        memcpy(a + i * 4, b + i * 4, 4);
+        memcpy(b + i * 4, &v, 4);
+    }
+}
+
+// Flips happen in place, so they don't need a second copy of the bitmap: each
+// pixel swaps with its mirror pixel. For tiled bitmaps the tiles involved are
+// made writable first, so a tile that can't be allocated fails the flip before
+// any pixel has moved.
+struct FlipJob {
+    Bitmap *bitmap;
+    Rect rect;
+    unsigned char *allocated; // Tiled bitmaps, whether each tile existed before the flip
+    std::atomic<bool> failed;
+};
+
+// Makes the tiles of tile row `ty` writable when they, or a tile holding
+// part of their mirror image, are allocated. Tile (tx, ty) mirrors the
+// columns of tile row `ty` when `horizontal` is set, and the rows of tile
+// column `tx` otherwise.
+static void bitmap_flip_prepare_tiles(FlipJob *job, int ty, bool horizontal) {
+    Bitmap *bitmap = job->bitmap;
+    for (int tx = 0; tx < bitmap->tiles_x; tx++) {
+        int x1 = tx << TILE_SHIFT;
+        int y1 = ty << TILE_SHIFT;
+        bool needed = job->allocated[ty * bitmap->tiles_x + tx];
+        if (horizontal) {
+            int x2 = MIN(bitmap->width, x1 + TILE_SIZE) - 1;
+            for (int m = (bitmap->width - 1 - x2) >> TILE_SHIFT; m <= (bitmap->width - 1 - x1) >> TILE_SHIFT && !needed; m++) {
+                needed = job->allocated[ty * bitmap->tiles_x + m];
+            }
+        } else {
+            int y2 = MIN(bitmap->height, y1 + TILE_SIZE) - 1;
+            for (int m = (bitmap->height - 1 - y2) >> TILE_SHIFT; m <= (bitmap->height - 1 - y1) >> TILE_SHIFT && !needed; m++) {
+                needed = job->allocated[m * bitmap->tiles_x + tx];
+            }
+        }
+        if (needed && bitmap_pixel_address(bitmap, x1, y1, true) == NULL) {
+            job->failed = true;
+            return;
+        }
+    }
+}
+
+static void bitmap_flip_prepare_horizontal(int index, void *data) {
+    FlipJob *job = (FlipJob*)data;
+    bitmap_flip_prepare_tiles(job, (job->rect.y >> TILE_SHIFT) + index, true);
+}
+
+// Vertical flips prepare every row of tiles, which lets the swaps that follow
+// write pixels only, never tile pointers, even when their jobs share tiles
+static void bitmap_flip_prepare_vertical(int ty, void *data) {
+    bitmap_flip_prepare_tiles((FlipJob*)data, ty, false);
+}
+
+// Takes a snapshot of which tiles are allocated and makes the ones the flip
+// writes to writable, returning false when that runs out of memory
+static bool bitmap_flip_prepare(FlipJob *job, int rows, ParallelFunc prepare) {
+    Bitmap *bitmap = job->bitmap;
+    if (bitmap->storage == STORAGE_FLAT) {
+        return true;
+    }
+    int count = bitmap->tiles_x * bitmap->tiles_y;
+    job->allocated = (unsigned char*)malloc(count);
+    if (job->allocated == NULL) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        job->allocated[i] = bitmap->tiles[i] != NULL;
+    }
+    parallel_for(rows, prepare, job);
+    free(job->allocated);
+    return !job->failed;
+}
+
+// Swaps the left half of each row with its mirror image in the right half.
+// Every row stays in its own row of tiles, which belongs to this job.
+static void bitmap_flip_horizontal_rows(int index, void *data) {
+    FlipJob *job = (FlipJob*)data;
+    Bitmap *bitmap = job->bitmap;
+    Rect r = rect_tile_row(job->rect, index);
+    int half = bitmap->width / 2;
+    for (int y = r.y; y < r.y + r.height; y++) {
+        int x = 0;
+        while (x < half) {
+            // The last pixel of the mirror run, which is stored contiguously
+            // back to the start of its tile
+            int mirror = bitmap->width - 1 - x;
+            int count = MIN(bitmap_span_length(bitmap, x), half - x);
+            if (bitmap->storage == STORAGE_TILED) {
+                count = MIN(count, (mirror & TILE_MASK) + 1);
+            }
+            unsigned char *a = bitmap_pixel_address(bitmap, x, y, false);
+            unsigned char *b = bitmap_pixel_address(bitmap, mirror - count + 1, y, false);
+            if (a != NULL && b != NULL) {
+                swap_pixels_reversed(a, b, count);
+            }
+            x += count;
+        }
+    }
+}
+
+// Swaps rows of the top half with their mirror rows in the bottom half. A
+// tile missing on one side is missing on the other, so both are transparent.
+static void bitmap_flip_vertical_rows(int index, void *data) {
+    FlipJob *job = (FlipJob*)data;
+    Bitmap *bitmap = job->bitmap;
+    Rect r = rect_tile_row(job->rect, index);
+    for (int y = r.y; y < r.y + r.height; y++) {
+        int x = 0;
+        while (x < bitmap->width) {
+            int count = bitmap_span_length(bitmap, x);
+            unsigned char *a = bitmap_pixel_address(bitmap, x, y, false);
+            unsigned char *b = bitmap_pixel_address(bitmap, x, bitmap->height - 1 - y, false);
+            if (a != NULL && b != NULL) {
+                swap_pixels(a, b, count);
+            }
+            x += count;
+        }
+    }
+}
+
+// The content is mirrored, but stays a bound for tiles that were allocated
+// and are now transparent. A flip that failed leaves the pixels as they were,
+// though some tiles of the mirror image may have been allocated already.
+static bool bitmap_finish_flip(Bitmap *bitmap, Rect mirrored, bool flipped) {
+    if (!flipped) {
+        bitmap->content = rect_union(bitmap->content, mirrored);
+        return false;
+    }
+    bitmap_mark_dirty(bitmap, rect_union(bitmap->content, mirrored));
+    return true;
+}
+
+bool bitmap_flip_horizontal(Bitmap *bitmap) {
+    Rect content = rect_intersect(bitmap->content, Rect { 0, 0, bitmap->width, bitmap->height });
+    if (rect_is_empty(content)) {
+        return true;
+    }
+    // Rows outside the content are transparent, which flipping doesn't change
+    FlipJob job = { bitmap, Rect { 0, content.y, bitmap->width, content.height }, NULL, {false} };
+    Rect mirrored = Rect { bitmap->width - content.x - content.width, content.y, content.width, content.height };
+    if (!bitmap_flip_prepare(&job, rect_tile_rows(job.rect), bitmap_flip_prepare_horizontal)) {
+        return bitmap_finish_flip(bitmap, mirrored, false);
+    }
+    parallel_for(rect_tile_rows(job.rect), bitmap_flip_horizontal_rows, &job);
+    return bitmap_finish_flip(bitmap, mirrored, true);
+}
+
+bool bitmap_flip_vertical(Bitmap *bitmap) {
+    Rect content = rect_intersect(bitmap->content, Rect { 0, 0, bitmap->width, bitmap->height });
+    if (rect_is_empty(content) || bitmap->height < 2) {
+        return true;
+    }
+    FlipJob job = { bitmap, Rect { 0, 0, bitmap->width, bitmap->height / 2 }, NULL, {false} };
+    Rect mirrored = Rect { content.x, bitmap->height - content.y - content.height, content.width, content.height };
+    if (!bitmap_flip_prepare(&job, bitmap->tiles_y, bitmap_flip_prepare_vertical)) {
+        return bitmap_finish_flip(bitmap, mirrored, false);
+    }
+    parallel_for(rect_tile_rows(job.rect), bitmap_flip_vertical_rows, &job);
+    return bitmap_finish_flip(bitmap, mirrored, true);
+}
+
+// Averages the 2x2 source pixels `p` into `d`. Straight colours are weighted
+// by alpha, so fully transparent pixels don't darken the edges they border.
+static void downsample_pixel(unsigned char *d, const unsigned char *p[4], bool weighted) {
+    int alpha = p[0][3] + p[1][3] + p[2][3] + p[3][3];
+    for (int c = 0; c < 3; c++) {
+        if (!weighted) {
+            d[c] = (p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) >> 2;
+        } else if (alpha == 0) {
+            d[c] = 0;
+        } else {
+            d[c] = (p[0][c] * p[0][3] + p[1][c] * p[1][3] + p[2][c] * p[2][3] + p[3][c] * p[3][3] + alpha / 2) / alpha;
+        }
+    }
+    d[3] = (alpha + 2) >> 2;
+}
+
+// Downsamples the pixel in column `x` from source rows `row0` and `row1`. The
+// last column of an odd width source is paired with itself.
+static void downsample_column(unsigned char *d, const unsigned char *row0, const unsigned char *row1, int x, int source_width, bool weighted) {
+    int sx0 = 2 * x;
+    int sx1 = MIN(sx0 + 1, source_width - 1);
+    const unsigned char *p[4] = { row0 + sx0 * 4, row0 + sx1 * 4, row1 + sx0 * 4, row1 + sx1 * 4 };
+    downsample_pixel(d, p, weighted);
+}
+
+#ifdef __SSE2__
+// Sums the two pixels in each half of a row pair, which is one output pixel
+// each, into the low four 16-bit lanes of the result
+static inline __m128i downsample_sum(__m128i a, __m128i b) {
+    __m128i v = _mm_add_epi16(a, b);
+    return _mm_add_epi16(v, _mm_srli_si128(v, 8));
+}
+#endif
+
+// Writes `count` pixels from `x` on of a row downsampled from rows `row0` and
+// `row1` of a source `source_width` pixels wide
+static void downsample_row(unsigned char *dst, const unsigned char *row0, const unsigned char *row1, int x, int count, int source_width, bool straight) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(2);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    for (; i + 4 <= count && 2 * (x + i + 4) <= source_width; i += 4) {
+        const unsigned char *s0 = row0 + (x + i) * 8;
+        const unsigned char *s1 = row1 + (x + i) * 8;
+        __m128i a0 = _mm_loadu_si128((const __m128i*)s0);
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(s0 + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i*)s1);
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(s1 + 16));
+        if (straight) {
+            // Plain averages are only right for straight colours if every pixel is opaque
+            __m128i opaque = _mm_and_si128(_mm_and_si128(a0, a1), _mm_and_si128(b0, b1));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(opaque, alpha), alpha)) != 0xffff) {
+                for (int k = i; k < i + 4; k++) {
+                    downsample_column(dst + k * 4, row0, row1, x + k, source_width, true);
+                }
+                continue;
+            }
+        }
+        __m128i p0 = downsample_sum(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        __m128i p1 = downsample_sum(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        __m128i p2 = downsample_sum(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        __m128i p3 = downsample_sum(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+        __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(p0, p1), round), 2);
+        __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(p2, p3), round), 2);
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < count; i++) {
+        downsample_column(dst + i * 4, row0, row1, x + i, source_width, straight);
+    }
+}
+
+struct DownsampleJob {
+    Bitmap *bitmap;
+    Bitmap *source;
+    Rect rect;
+};
+
+static void bitmap_downsample_rows(int index, void *data) {
+    DownsampleJob *job = (DownsampleJob*)data;
+    Bitmap *bitmap = job->bitmap;
+    Bitmap *source = job->source;
+    Rect r = rect_tile_row(job->rect, index);
+    bool straight = source->format == PIXEL_STRAIGHT;
+    if (bitmap->storage == STORAGE_FLAT && source->storage == STORAGE_FLAT) {
+        for (int y = r.y; y < r.y + r.height; y++) {
+            const unsigned char *row0 = bitmap_pixel_address(source, 0, 2 * y, false);
+            const unsigned char *row1 = bitmap_pixel_address(source, 0, MIN(2 * y + 1, source->height - 1), false);
+            downsample_row(bitmap_pixel_address(bitmap, r.x, y, true), row0, row1, r.x, r.width, source->width, straight);
+        }
+        return;
+    }
+    // Tiled rows aren't contiguous, so the source pixels under each span of
+    // up to a tile are gathered first
+    unsigned char row0[TILE_SIZE * 8];
+    unsigned char row1[TILE_SIZE * 8];
+    unsigned char out[TILE_SIZE * 4];
+    for (int y = r.y; y < r.y + r.height; y++) {
+        int x = r.x;
+        while (x < r.x + r.width) {
+            int count = MIN(MIN(r.x + r.width - x, bitmap_span_length(bitmap, x)), TILE_SIZE);
+            int source_count = MIN(2 * count, source->width - 2 * x);
+            bitmap_read_pixels(source, 2 * x, 2 * y, source_count, 1, row0, 0);
+            bitmap_read_pixels(source, 2 * x, MIN(2 * y + 1, source->height - 1), source_count, 1, row1, 0);
+            if (pixels_are_empty(row0, source_count) && pixels_are_empty(row1, source_count)) {
+                memset(out, 0, count * 4);
+            } else {
+                downsample_row(out, row0, row1, 0, count, source_count, straight);
+            }
+            bitmap_store_block(bitmap, x, y, count, 1, out, 0);
+            x += count;
+        }
+    }
+}
+
+// Sets `r` of the bitmap to a 2x2 box filtered copy of the source, which is
+// twice its size, rounded up. Either may be tiled, in which case transparent
+// parts of the source don't allocate tiles in the bitmap.
+void bitmap_downsample(Bitmap *bitmap, Bitmap *source, Rect r) {
+    r = rect_intersect(r, Rect { 0, 0, bitmap->width, bitmap->height });
+    if (rect_is_empty(r)) {
+        return;
+    }
+    bitmap_mark_dirty(bitmap, r);
+    DownsampleJob job = { bitmap, source, r };
+    parallel_for(rect_tile_rows(r), bitmap_downsample_rows, &job);
+}
+
 void bitmap_free(Bitmap *bitmap) {
     free(bitmap->data);
+    if (bitmap->tiles != NULL) {
+        for (int i = 0; i < bitmap->tiles_x * bitmap->tiles_y; i++) {
+            tile_release(bitmap->tiles[i]);
+        }
+        free(bitmap->tiles);
+    }
 }
 
 bool bitmap_get_pixel(Bitmap *bitmap, int x, int y, Color *color) {
-    int w = bitmap->width;
-    int h = bitmap->height;
-    if (x >= 0 && x < w && y >= 0 && y < h)  {
-        color->r = bitmap->data[(y * w + x) * 4];
-        color->g = bitmap->data[(y * w + x) * 4 + 1];
-        color->b = bitmap->data[(y * w + x) * 4 + 2];
-        color->a = bitmap->data[(y * w + x) * 4 + 3];
+    if (x >= 0 && x < bitmap->width && y >= 0 && y < bitmap->height)  {
+        unsigned char *p = bitmap_pixel_address(bitmap, x, y, false);
+        if (p == NULL) {
+            *color = Color { 0, 0, 0, 0 };
+            return true;
+        }
+        color->r = p[0];
+        color->g = p[1];
+        color->b = p[2];
+        color->a = p[3];
+        if (bitmap->format == PIXEL_PREMULTIPLIED) {
+            *color = color_unpremultiply(*color);
+        }
         return true;
     }
     return false;
 }
 
 bool bitmap_draw_pixel(Bitmap *bitmap, int x, int y, Color color) {
-    int offset = (y * bitmap->width + x) * 4;
     if (x >= 0 && x < bitmap->width && y >= 0 && y < bitmap->height)  {
-        bitmap->data[offset] = color.r;
-        bitmap->data[offset + 1] = color.g;
-        bitmap->data[offset + 2] = color.b;
-        bitmap->data[offset + 3] = color.a;
+        if (bitmap->format == PIXEL_PREMULTIPLIED) {
+            color = color_premultiply(color);
+        }
+        unsigned char *p = bitmap_store_address(bitmap, x, y, load_pixel((const unsigned char*)&color));
+        if (p != NULL) {
+            p[0] = color.r;
+            p[1] = color.g;
+            p[2] = color.b;
+            p[3] = color.a;
+        }
+        bitmap_mark_dirty(bitmap, Rect { x, y, 1, 1 });
         return true;
     }
     return false;
 }
 
-bool bitmap_blend(Bitmap *bitmap, Bitmap *other, int offset_x, int offset_y) {
-    // Only blend the portion of the other bitmap that overlaps with the base
-    int width = MIN(other->width, bitmap->width - offset_x);
-    int height = MIN(other->height, bitmap->height - offset_y);
-    if (bitmap->width >= other->width && bitmap->height >= other->height) {
-        for (int y = MAX(0, offset_y); y < offset_y + height; y++) {
-            for (int x = MAX(0, offset_x); x < MIN(bitmap->width, offset_x + width); x++) {
-                int i = (y * bitmap->width + x) * 4;
-                int oi = ((y - offset_y) * other->width + (x - offset_x)) * 4;
-
-                // The common cases are 0 or full alpha, so make those fast
-                if (other->data[oi + 3] == 0) {
-                    continue;
+// Copies a block of pixels already in the bitmap's format (rows `stride` bytes
+// apart) to (x, y). The block must lie inside the bitmap. Transparent runs
+// don't allocate tiles that are still missing.
+struct WritePixelsJob {
+    Bitmap *bitmap;
+    Rect rect;
+    const unsigned char *src;
+    int stride;
+};
+
+static void bitmap_write_pixels_row(int index, void *data) {
+    WritePixelsJob *job = (WritePixelsJob*)data;
+    Rect r = rect_tile_row(job->rect, index);
+    const unsigned char *src = job->src + (long long)(r.y - job->rect.y) * job->stride;
+    bitmap_store_block(job->bitmap, r.x, r.y, r.width, r.height, src, job->stride);
+}
+
+void bitmap_write_pixels(Bitmap *bitmap, int x, int y, int width, int height, const unsigned char *src, int stride) {
+    Rect r = { x, y, width, height };
+    if (rect_is_empty(r)) {
+        return;
+    }
+    bitmap_mark_dirty(bitmap, r);
+    WritePixelsJob job = { bitmap, r, src, stride };
+    parallel_for(rect_tile_rows(r), bitmap_write_pixels_row, &job);
+}
+
+// Copies a block of pixels out of the bitmap into `dst`, rows `stride` bytes
+// apart. Unallocated tiles read as transparent. The block must lie inside the bitmap.
+void bitmap_read_pixels(Bitmap *bitmap, int x, int y, int width, int height, unsigned char *dst, int stride) {
+    for (int row = 0; row < height; row++) {
+        unsigned char *d = dst + (long long)row * stride;
+        int sx = x;
+        while (sx < x + width) {
+            int count = MIN(x + width - sx, bitmap_span_length(bitmap, sx));
+            const unsigned char *p = bitmap_pixel_address(bitmap, sx, y + row, false);
+            if (p != NULL) {
+                memcpy(d, p, count * 4);
+            } else {
+                memset(d, 0, count * 4);
+            }
+            d += count * 4;
+            sx += count;
+        }
+    }
+}
+
+// Blends a block of `width` x `rows` pixels read from `src` (rows `stride`
+// bytes apart) onto the bitmap at (x, y). The block must lie inside the bitmap.
+// Transparent runs change nothing, so they don't allocate or copy tiles.
+static void bitmap_blend_block(Bitmap *bitmap, int x, int y, int width, int rows, const unsigned char *src, int stride) {
+    for (int row = 0; row < rows; row++) {
+        const unsigned char *s = src + row * stride;
+        int dx = x;
+        int remaining = width;
+        while (remaining > 0) {
+            int count = MIN(remaining, bitmap_span_length(bitmap, dx));
+            unsigned char *p = pixels_are_empty(s, count) ? NULL : bitmap_pixel_address(bitmap, dx, y + row, true);
+            if (p != NULL) {
+                if (bitmap->format == PIXEL_PREMULTIPLIED) {
+                    blend_span_premultiplied(p, s, count);
+                } else {
+                    blend_span(p, s, count);
                 }
-                if (other->data[oi + 3] == 255) {
-                    bitmap->data[i] = other->data[oi];
-                    bitmap->data[i + 1] = other->data[oi + 1];
-                    bitmap->data[i + 2] = other->data[oi + 2];
-                    bitmap->data[i + 3] = other->data[oi + 3];
-                    continue;
+            }
+            s += count * 4;
+            dx += count;
+            remaining -= count;
+        }
+    }
+}
+
+static bool mask_is_empty(const unsigned char *mask, int count) {
+    for (int i = 0; i < count; i++) {
+        if (mask[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Blends `color` through an 8 bit coverage mask of `width` x `height` (rows
+// `stride` bytes apart) placed with its top left corner at (x, y), or erases
+// by it when `erase` is set. Parts outside the bitmap are skipped.
+static void bitmap_stamp_mask(Bitmap *bitmap, const unsigned char *mask, int width, int height, int stride, int x, int y, Color color, bool erase) {
+    Rect r = rect_intersect(Rect { x, y, width, height }, Rect { 0, 0, bitmap->width, bitmap->height });
+    if (rect_is_empty(r)) {
+        return;
+    }
+    bitmap_mark_dirty(bitmap, r);
+    for (int row = r.y; row < r.y + r.height; row++) {
+        const unsigned char *m = mask + (row - y) * stride + (r.x - x);
+        int dx = r.x;
+        int remaining = r.width;
+        while (remaining > 0) {
+            int count = MIN(remaining, bitmap_span_length(bitmap, dx));
+            // Uncovered runs don't touch the bitmap, and erasing a missing tile changes nothing
+            bool skip = mask_is_empty(m, count) || (erase && bitmap_pixel_address(bitmap, dx, row, false) == NULL);
+            unsigned char *p = skip ? NULL : bitmap_pixel_address(bitmap, dx, row, true);
+            if (p != NULL) {
+                if (erase) {
+                    erase_span_masked(p, m, bitmap->format, count);
+                } else {
+                    blend_span_masked(p, m, color, bitmap->format, count);
                 }
+            }
+            m += count;
+            dx += count;
+            remaining -= count;
+        }
+    }
+}
+
+void bitmap_stamp(Bitmap *bitmap, const unsigned char *mask, int width, int height, int stride, int x, int y, Color color) {
+    bitmap_stamp_mask(bitmap, mask, width, height, stride, x, y, color, false);
+}
 
-                // Uncommon case (normal blending)
-                double a1 = (double)other->data[oi + 3] / 255.0f;
-                double a2 = (double)bitmap->data[i + 3] / 255.0f;
-                double factor = a2 * (1.0f - a1);
-                bitmap->data[i]     = (unsigned char)((double)bitmap->data[i]     * a1 + (double)other->data[oi]     * factor) / (a1 + factor);
-                bitmap->data[i + 1] = (unsigned char)((double)bitmap->data[i + 1] * a1 + (double)other->data[oi + 1] * factor) / (a1 + factor);
-                bitmap->data[i + 2] = (unsigned char)((double)bitmap->data[i + 2] * a1 + (double)other->data[oi + 2] * factor) / (a1 + factor);
-                bitmap->data[i + 3] = (unsigned char)((a1 + factor) * 255.0f);
+void bitmap_erase_stamp(Bitmap *bitmap, const unsigned char *mask, int width, int height, int stride, int x, int y) {
+    bitmap_stamp_mask(bitmap, mask, width, height, stride, x, y, Color { 0, 0, 0, 0 }, true);
+}
+
+struct BlendJob {
+    Bitmap *bitmap;
+    Bitmap *other;
+    int offset_x;
+    int offset_y;
+    Rect rect; // Already clipped to both bitmaps
+};
+
+static void bitmap_blend_row(int index, void *data) {
+    BlendJob *job = (BlendJob*)data;
+    Bitmap *other = job->other;
+    Rect r = rect_tile_row(job->rect, index);
+    int x1 = r.x;
+    int y1 = r.y;
+    int x2 = r.x + r.width;
+    int y2 = r.y + r.height;
+
+    if (other->storage == STORAGE_FLAT) {
+        const unsigned char *src = other->data + ((size_t)(y1 - job->offset_y) * other->width + (x1 - job->offset_x)) * 4;
+        bitmap_blend_block(job->bitmap, x1, y1, x2 - x1, y2 - y1, src, other->width * 4);
+        return;
+    }
+
+    // Unallocated tiles are fully transparent, so only the allocated ones need blending
+    for (int ty = (y1 - job->offset_y) >> TILE_SHIFT; ty <= (y2 - 1 - job->offset_y) >> TILE_SHIFT; ty++) {
+        for (int tx = (x1 - job->offset_x) >> TILE_SHIFT; tx <= (x2 - 1 - job->offset_x) >> TILE_SHIFT; tx++) {
+            Tile *tile = other->tiles[ty * other->tiles_x + tx];
+            if (tile == NULL) {
+                continue;
+            }
+            int tile_x = job->offset_x + tx * TILE_SIZE;
+            int tile_y = job->offset_y + ty * TILE_SIZE;
+            int bx1 = MAX(x1, tile_x);
+            int by1 = MAX(y1, tile_y);
+            int bx2 = MIN(x2, tile_x + TILE_SIZE);
+            int by2 = MIN(y2, tile_y + TILE_SIZE);
+            if (bx1 < bx2 && by1 < by2) {
+                const unsigned char *src = tile->data + (((by1 - tile_y) << TILE_SHIFT) + (bx1 - tile_x)) * 4;
+                bitmap_blend_block(job->bitmap, bx1, by1, bx2 - bx1, by2 - by1, src, TILE_SIZE * 4);
             }
         }
+    }
+}
+
+bool bitmap_blend(Bitmap *bitmap, Bitmap *other, int offset_x, int offset_y) {
+    return bitmap_blend_rect(bitmap, other, offset_x, offset_y, Rect { 0, 0, bitmap->width, bitmap->height });
+}
+
+// Like bitmap_blend, but only touches the base bitmap inside `clip`
+bool bitmap_blend_rect(Bitmap *bitmap, Bitmap *other, int offset_x, int offset_y, Rect clip) {
+    if (bitmap->width < other->width || bitmap->height < other->height) {
+        return false;
+    }
+    if (bitmap->format != other->format) {
+        printf("Cannot blend bitmaps with different pixel formats\n");
+        return false;
+    }
+
+    // Only blend the painted portion of the other bitmap that overlaps with the base
+    Rect r = rect_intersect(
+            rect_intersect(clip, Rect { 0, 0, bitmap->width, bitmap->height }),
+            rect_offset(rect_intersect(other->content, Rect { 0, 0, other->width, other->height }), offset_x, offset_y));
+    if (rect_is_empty(r)) {
+        return true;
+    }
+    BlendJob job = { bitmap, other, offset_x, offset_y, r };
+    parallel_for(rect_tile_rows(r), bitmap_blend_row, &job);
+    bitmap_mark_dirty(bitmap, r);
+    return true;
+}
+
+bool bitmap_blend_pixel(Bitmap *bitmap, int x, int y, Color color) {
+    if (x >= 0 && x < bitmap->width && y >= 0 && y < bitmap->height)  {
+        if (color.a == 0) {
+            return true;
+        }
+        unsigned char *p = bitmap_pixel_address(bitmap, x, y, true);
+        if (p == NULL) {
+            return true;
+        }
+        if (bitmap->format == PIXEL_PREMULTIPLIED) {
+            color = color_premultiply(color);
+            blend_span_premultiplied(p, (const unsigned char*)&color, 1);
+        } else {
+            blend_span(p, (const unsigned char*)&color, 1);
+        }
+        bitmap_mark_dirty(bitmap, Rect { x, y, 1, 1 });
         return true;
     }
     return false;
 }
 
+// Clips the segment from (x1, y1) to (x2, y2), which takes `steps` steps along
+// its major axis, to the bitmap (Liang-Barsky). The steps that may land on the
+// bitmap are returned in [first, last], padded by one for rounding; returns
+// false when none do.
+static bool line_clip(Bitmap *bitmap, int x1, int y1, int x2, int y2, int steps, int *first, int *last) {
+    double p[4] = { -(double)(x2 - x1), (double)(x2 - x1), -(double)(y2 - y1), (double)(y2 - y1) };
+    double q[4] = { x1 + 0.5, bitmap->width - 0.5 - x1, y1 + 0.5, bitmap->height - 0.5 - y1 };
+    double t0 = 0;
+    double t1 = 1;
+    for (int i = 0; i < 4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0) {
+                return false;
+            }
+        } else if (p[i] < 0) {
+            t0 = MAX(t0, q[i] / p[i]);
+        } else {
+            t1 = MIN(t1, q[i] / p[i]);
+        }
+    }
+    if (t0 > t1) {
+        return false;
+    }
+    *first = MAX(0, (int)(t0 * steps) - 1);
+    *last = MIN(steps, (int)(t1 * steps) + 1);
+    return true;
+}
+
+// Integer Bresenham line. Only the clipped part of the line is walked, and
+// runs along the same row are written as one span.
 void bitmap_draw_line(Bitmap *bitmap, int x1, int y1, int x2, int y2, Color color) {
-    bitmap_draw_pixel(bitmap, x1, y1, color);
-    bitmap_draw_pixel(bitmap, x2, y2, color);
-    int width = abs(x2 - x1);
-    int height = abs(y2 - y1);
-    int step = width > height ? width : height;
-    if (step != 0) {
-        double dx = ((double)x2 - (double)x1) / (double)step;
-        double dy = ((double)y2 - (double)y1) / (double)step;
-        for (int i = 0; i < step; i++) {
-            bitmap_draw_pixel(
-                    bitmap,
-                    (int)((double)x1 + dx * (double)i),
-                    (int)((double)y1 + dy * (double)i),
-                    color);
-        }
-    }
-}
-
-void bitmap_fill(Bitmap *bitmap, int x, int y, Color color) {
-    Color targetColor;
-    if (bitmap_get_pixel(bitmap, x, y, &targetColor)) {
-        PointQueue q = pq_create();
-        Color currentColor;
-        Point p;
-        if (bitmap_get_pixel(bitmap, x, y, &currentColor)) {
-            if (color_eq(currentColor, color)) {
-                pq_free(&q);
-                return;
-            }
-        }
-        bitmap_draw_pixel(bitmap, x, y, color);
-        pq_push(&q, Point { x, y });
-        while (q.size > 0) {
-            if (pq_pop(&q, &p)) {
-                if (bitmap_get_pixel(bitmap, p.x - 1, p.y, &currentColor)) {
-                    if (color_eq(currentColor, targetColor)) {
-                        bitmap_draw_pixel(bitmap, p.x - 1, p.y, color);
-                        pq_push(&q, Point { p.x - 1, p.y });
-                    }
-                }
-                if (bitmap_get_pixel(bitmap, p.x + 1, p.y, &currentColor)) {
-                    if (color_eq(currentColor, targetColor)) {
-                        bitmap_draw_pixel(bitmap, p.x + 1, p.y, color);
-                        pq_push(&q, Point { p.x + 1, p.y });
-                    }
-                }
-                if (bitmap_get_pixel(bitmap, p.x, p.y - 1, &currentColor)) {
-                    if (color_eq(currentColor, targetColor)) {
-                        bitmap_draw_pixel(bitmap, p.x, p.y - 1, color);
-                        pq_push(&q, Point { p.x, p.y - 1 });
-                    }
-                }
-                if (bitmap_get_pixel(bitmap, p.x, p.y + 1, &currentColor)) {
-                    if (color_eq(currentColor, targetColor)) {
-                        bitmap_draw_pixel(bitmap, p.x, p.y + 1, color);
-                        pq_push(&q, Point { p.x, p.y + 1 });
-                    }
-                }
+    int adx = abs(x2 - x1);
+    int ady = abs(y2 - y1);
+    int sx = x2 >= x1 ? 1 : -1;
+    int sy = y2 >= y1 ? 1 : -1;
+    bool x_major = adx >= ady;
+    int major = x_major ? adx : ady;
+    int minor = x_major ? ady : adx;
+
+    int first;
+    int last;
+    if (!line_clip(bitmap, x1, y1, x2, y2, major, &first, &last)) {
+        return;
+    }
+    unsigned value = bitmap_pack_color(bitmap, color);
+
+    // The minor coordinate at step i is round(i * minor / major), kept as a
+    // quotient and remainder so the walk can start at any step
+    long long denominator = 2 * (long long)MAX(major, 1);
+    long long numerator = 2 * (long long)minor * first + MAX(major, 1);
+    long long offset = numerator / denominator;
+    long long remainder = numerator % denominator;
+
+    Rect drawn = { 0, 0, 0, 0 };
+    int run_start = 0;
+    int run_end = -1;
+    int run_y = 0;
+    for (int i = first; i <= last; i++) {
+        int x = x_major ? x1 + sx * i : x1 + sx * (int)offset;
+        int y = x_major ? y1 + sy * (int)offset : y1 + sy * i;
+        remainder += 2 * (long long)minor;
+        if (remainder >= denominator) {
+            remainder -= denominator;
+            offset++;
+        }
+        if (x < 0 || x >= bitmap->width || y < 0 || y >= bitmap->height) {
+            continue;
+        }
+
+        if (run_end >= run_start && y == run_y && (x == run_start - 1 || x == run_end + 1)) {
+            run_start = MIN(run_start, x);
+            run_end = MAX(run_end, x);
+            continue;
+        }
+        if (run_end >= run_start) {
+            bitmap_set_span(bitmap, run_start, run_end, run_y, value);
+            drawn = rect_union(drawn, Rect { run_start, run_y, run_end - run_start + 1, 1 });
+        }
+        run_start = x;
+        run_end = x;
+        run_y = y;
+    }
+    if (run_end >= run_start) {
+        bitmap_set_span(bitmap, run_start, run_end, run_y, value);
+        drawn = rect_union(drawn, Rect { run_start, run_y, run_end - run_start + 1, 1 });
+    }
+    bitmap_mark_dirty(bitmap, drawn);
+}
+
+// Antialiased line after Xiaolin Wu: every step along the major axis blends
+// the two pixels straddling the line, weighted by how close it passes. With
+// `skip_start`, (x1, y1) is left alone, for continuing a polyline from where
+// the last segment ended without blending the joint twice.
+void bitmap_draw_line_aa(Bitmap *bitmap, int x1, int y1, int x2, int y2, Color color, bool skip_start) {
+    int adx = abs(x2 - x1);
+    int ady = abs(y2 - y1);
+    bool x_major = adx >= ady;
+    int major = x_major ? adx : ady;
+
+    int first;
+    int last;
+    if (!line_clip(bitmap, x1, y1, x2, y2, major, &first, &last)) {
+        return;
+    }
+    if (skip_start) {
+        first = MAX(first, 1);
+    }
+    if (major == 0) {
+        if (!skip_start) {
+            bitmap_blend_pixel(bitmap, x1, y1, color);
+        }
+        return;
+    }
+
+    // Minor axis position in 16.16 fixed point
+    int step = x_major ? (x2 >= x1 ? 1 : -1) : (y2 >= y1 ? 1 : -1);
+    long long gradient = (long long)(x_major ? y2 - y1 : x2 - x1) * 65536 / major;
+    long long position = (long long)(x_major ? y1 : x1) * 65536 + gradient * first;
+    for (int i = first; i <= last; i++, position += gradient) {
+        int a = (x_major ? x1 : y1) + step * i;
+        int b = (int)(position >> 16);
+        int fraction = (int)(position & 0xffff) >> 8;
+        Color upper = color;
+        Color lower = color;
+        upper.a = (unsigned char)(color.a * (255 - fraction) / 255);
+        lower.a = (unsigned char)(color.a * fraction / 255);
+        if (x_major) {
+            bitmap_blend_pixel(bitmap, a, b, upper);
+            bitmap_blend_pixel(bitmap, a, b + 1, lower);
+        } else {
+            bitmap_blend_pixel(bitmap, b, a, upper);
+            bitmap_blend_pixel(bitmap, b + 1, a, lower);
+        }
+    }
+}
+
+void bitmap_fill_rect(Bitmap *bitmap, Rect rect, Color color) {
+    bitmap_set_rect(bitmap, rect, bitmap_pack_color(bitmap, color));
+}
+
+void bitmap_clear_rect(Bitmap *bitmap, Rect rect) {
+    bitmap_set_rect(bitmap, rect, 0);
+}
+
+// A run of pixels [x1, x2] on row y to scan. Every pixel in it is next to one
+// that was just filled, so each matching run found there joins the fill.
+struct FillSpan {
+    int x1;
+    int x2;
+    int y;
+};
+
+struct FillState {
+    Bitmap *bitmap;
+    unsigned target; // Seed pixel as stored
+    unsigned value; // Fill colour as stored
+    int tolerance; // Largest per channel difference from `target` that is filled
+    unsigned char *visited; // One bit per pixel, only needed with a tolerance
+    size_t visited_stride; // Bytes per row, whole tile rows are byte aligned
+    // Pending work is kept on stacks, so memory follows the fill's frontier
+    // rather than its area
+    FillSpan *spans;
+    int span_count;
+    int span_capacity;
+    int *tiles;
+    int tile_count;
+    int tile_capacity;
+    // Tiled bitmaps only: tiles that are missing or a single matching colour
+    // are filled as a whole, by sharing one solid tile
+    unsigned char *tile_done;
+    Tile *solid;
+    Tile *uniform; // Shared tile known to be entirely matching
+    Tile *checked; // Last shared tile checked for that
+    Rect filled;
+    bool failed; // Out of memory for the stacks, so nothing more is queued
+};
+
+// Stops the fill where it is. What has been filled so far stays filled.
+static void fill_fail(FillState *s) {
+    bitmap_allocation_failed("the fill");
+    s->failed = true;
+    s->span_count = 0;
+    s->tile_count = 0;
+}
+
+static void fill_push(FillState *s, int x1, int x2, int y) {
+    if (y < 0 || y >= s->bitmap->height || s->failed) {
+        return;
+    }
+    if (s->span_count == s->span_capacity) {
+        int capacity = s->span_capacity == 0 ? 256 : s->span_capacity * 2;
+        FillSpan *spans = (FillSpan*)realloc(s->spans, capacity * sizeof(FillSpan));
+        if (spans == NULL) {
+            fill_fail(s);
+            return;
+        }
+        s->spans = spans;
+        s->span_capacity = capacity;
+    }
+    s->spans[s->span_count++] = FillSpan { MAX(x1, 0), MIN(x2, s->bitmap->width - 1), y };
+}
+
+static void fill_mark_visited(FillState *s, int x1, int x2, int y) {
+    unsigned char *row = s->visited + y * s->visited_stride;
+    int x = x1;
+    for (; x <= x2 && (x & 7) != 0; x++) {
+        row[x >> 3] |= 1 << (x & 7);
+    }
+    if (x2 - x + 1 >= 8) {
+        memset(row + (x >> 3), 0xff, (x2 - x + 1) >> 3);
+        x += (x2 - x + 1) & ~7;
+    }
+    for (; x <= x2; x++) {
+        row[x >> 3] |= 1 << (x & 7);
+    }
+}
+
+static bool fill_matches_color(FillState *s, unsigned pixel) {
+    if (s->visited == NULL) {
+        return pixel == s->target;
+    }
+    for (int shift = 0; shift < 32; shift += 8) {
+        int a = (pixel >> shift) & 0xff;
+        int b = (s->target >> shift) & 0xff;
+        if (a - b > s->tolerance || b - a > s->tolerance) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool fill_matches(FillState *s, unsigned pixel, int x, int y) {
+    if (s->visited != NULL && ((s->visited[y * s->visited_stride + (x >> 3)] >> (x & 7)) & 1)) {
+        return false;
+    }
+    return fill_matches_color(s, pixel);
+}
+
+// Whether every pixel of the tile should be filled. Large areas filled before
+// share one solid tile, so only shared tiles are checked, and only once.
+static bool fill_tile_matches(FillState *s, Tile *tile) {
+    if (tile == NULL) {
+        return fill_matches_color(s, 0);
+    }
+    if (tile == s->uniform) {
+        return true;
+    }
+    if (tile->refcount < 2 || tile == s->checked) {
+        return false;
+    }
+    s->checked = tile;
+    unsigned first = load_pixel(tile->data);
+    if (!fill_matches_color(s, first)) {
+        return false;
+    }
+    for (int i = 1; i < TILE_SIZE * TILE_SIZE; i++) {
+        if (load_pixel(tile->data + i * 4) != first) {
+            return false;
+        }
+    }
+    s->uniform = tile;
+    return true;
+}
+
+// Returns the first x in [x, x2] that should be filled, or x2 + 1
+static int fill_find(FillState *s, int x, int x2, int y) {
+    Bitmap *bitmap = s->bitmap;
+    while (x <= x2) {
+        int count = MIN(x2 - x + 1, bitmap_span_length(bitmap, x));
+        const unsigned char *p = bitmap_pixel_address(bitmap, x, y, false);
+        for (int i = 0; i < count; i++) {
+            if (fill_matches(s, p == NULL ? 0 : load_pixel(p + i * 4), x + i, y)) {
+                return x + i;
             }
         }
-        pq_free(&q);
+        x += count;
     }
+    return x;
+}
+
+// Returns the first x at or after `x` that shouldn't be filled
+static int fill_scan_right(FillState *s, int x, int y) {
+    Bitmap *bitmap = s->bitmap;
+    while (x < bitmap->width) {
+        int count = bitmap_span_length(bitmap, x);
+        const unsigned char *p = bitmap_pixel_address(bitmap, x, y, false);
+        if (p == NULL && s->visited == NULL) {
+            // A missing tile is a run of transparent pixels
+            if (s->target != 0) {
+                return x;
+            }
+            x += count;
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            if (!fill_matches(s, p == NULL ? 0 : load_pixel(p + i * 4), x + i, y)) {
+                return x + i;
+            }
+        }
+        x += count;
+    }
+    return bitmap->width;
+}
+
+// Returns the last x at or before `x` that shouldn't be filled
+static int fill_scan_left(FillState *s, int x, int y) {
+    Bitmap *bitmap = s->bitmap;
+    while (x >= 0) {
+        int count = bitmap->storage == STORAGE_FLAT ? x + 1 : (x & TILE_MASK) + 1;
+        const unsigned char *p = bitmap_pixel_address(bitmap, x, y, false);
+        if (p == NULL && s->visited == NULL) {
+            if (s->target != 0) {
+                return x;
+            }
+            x -= count;
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            if (!fill_matches(s, p == NULL ? 0 : load_pixel(p - i * 4), x - i, y)) {
+                return x - i;
+            }
+        }
+        x -= count;
+    }
+    return -1;
+}
+
+static void fill_tile(FillState *s, int index) {
+    Bitmap *bitmap = s->bitmap;
+    int x = (index % bitmap->tiles_x) * TILE_SIZE;
+    int y = (index / bitmap->tiles_x) * TILE_SIZE;
+    Rect r = rect_intersect(Rect { x, y, TILE_SIZE, TILE_SIZE }, Rect { 0, 0, bitmap->width, bitmap->height });
+
+    s->tile_done[index] = 1;
+    bitmap_set_tile(bitmap, index, s->solid);
+    if (s->visited != NULL) {
+        for (int row = r.y; row < r.y + r.height; row++) {
+            fill_mark_visited(s, r.x, r.x + r.width - 1, row);
+        }
+    }
+    s->filled = rect_union(s->filled, r);
+
+    if (s->failed) {
+        return;
+    }
+    if (s->tile_count == s->tile_capacity) {
+        int capacity = s->tile_capacity == 0 ? 64 : s->tile_capacity * 2;
+        int *tiles = (int*)realloc(s->tiles, capacity * sizeof(int));
+        if (tiles == NULL) {
+            fill_fail(s);
+            return;
+        }
+        s->tiles = tiles;
+        s->tile_capacity = capacity;
+    }
+    s->tiles[s->tile_count++] = index;
+}
+
+// Spreads the fill from a completely filled tile to its neighbours. Matching
+// neighbours are filled whole as well, and only the edges facing the others
+// are scanned pixel by pixel.
+static void fill_tile_neighbours(FillState *s, int index) {
+    Bitmap *bitmap = s->bitmap;
+    int tx = index % bitmap->tiles_x;
+    int ty = index / bitmap->tiles_x;
+    int x1 = tx * TILE_SIZE;
+    int y1 = ty * TILE_SIZE;
+    int x2 = MIN(x1 + TILE_SIZE, bitmap->width) - 1;
+    int y2 = MIN(y1 + TILE_SIZE, bitmap->height) - 1;
+
+    if (ty > 0 && !s->tile_done[index - bitmap->tiles_x]) {
+        if (fill_tile_matches(s, bitmap->tiles[index - bitmap->tiles_x])) {
+            fill_tile(s, index - bitmap->tiles_x);
+        } else {
+            fill_push(s, x1, x2, y1 - 1);
+        }
+    }
+    if (ty < bitmap->tiles_y - 1 && !s->tile_done[index + bitmap->tiles_x]) {
+        if (fill_tile_matches(s, bitmap->tiles[index + bitmap->tiles_x])) {
+            fill_tile(s, index + bitmap->tiles_x);
+        } else {
+            fill_push(s, x1, x2, y2 + 1);
+        }
+    }
+    if (tx > 0 && !s->tile_done[index - 1]) {
+        if (fill_tile_matches(s, bitmap->tiles[index - 1])) {
+            fill_tile(s, index - 1);
+        } else {
+            for (int y = y1; y <= y2; y++) {
+                fill_push(s, x1 - 1, x1 - 1, y);
+            }
+        }
+    }
+    if (tx < bitmap->tiles_x - 1 && !s->tile_done[index + 1]) {
+        if (fill_tile_matches(s, bitmap->tiles[index + 1])) {
+            fill_tile(s, index + 1);
+        } else {
+            for (int y = y1; y <= y2; y++) {
+                fill_push(s, x2 + 1, x2 + 1, y);
+            }
+        }
+    }
+}
+
+static void fill_span(FillState *s, int x1, int x2, int y) {
+    Bitmap *bitmap = s->bitmap;
+    s->filled = rect_union(s->filled, Rect { x1, y, x2 - x1 + 1, 1 });
+    if (s->visited != NULL) {
+        fill_mark_visited(s, x1, x2, y);
+    }
+    int x = x1;
+    while (x <= x2) {
+        int count = MIN(x2 - x + 1, bitmap_span_length(bitmap, x));
+        int index = (y >> TILE_SHIFT) * bitmap->tiles_x + (x >> TILE_SHIFT);
+        if (bitmap->storage == STORAGE_TILED && fill_tile_matches(s, bitmap->tiles[index])) {
+            fill_tile(s, index);
+        } else {
+            unsigned *p = (unsigned*)bitmap_pixel_address(bitmap, x, y, true);
+            for (int i = 0; p != NULL && i < count; i++) {
+                p[i] = s->value;
+            }
+        }
+        x += count;
+    }
+}
+
+// Scanline fill: each matching run is found with packed 32 bit compares,
+// extended left and right, filled in one pass, and the rows above and below it
+// are queued for scanning. Missing and uniform tiles are filled whole.
+void bitmap_fill(Bitmap *bitmap, int x, int y, Color color, int tolerance) {
+    if (x < 0 || x >= bitmap->width || y < 0 || y >= bitmap->height) {
+        return;
+    }
+    if (bitmap->format == PIXEL_PREMULTIPLIED) {
+        color = color_premultiply(color);
+    }
+    const unsigned char *seed = bitmap_pixel_address(bitmap, x, y, false);
+
+    FillState s = {};
+    s.bitmap = bitmap;
+    s.target = seed == NULL ? 0 : load_pixel(seed);
+    memcpy(&s.value, &color, 4);
+    s.tolerance = tolerance;
+    if (tolerance > 0) {
+        // Filled pixels may still be within the tolerance, so remember them
+        s.visited_stride = (bitmap->width + TILE_SIZE - 1) / TILE_SIZE * (TILE_SIZE / 8);
+        s.visited = (unsigned char*)calloc(s.visited_stride * bitmap->height, 1);
+        if (s.visited == NULL) {
+            bitmap_allocation_failed("the fill");
+            return;
+        }
+    } else if (s.value == s.target) {
+        return;
+    }
+    if (bitmap->storage == STORAGE_TILED) {
+        s.tile_done = (unsigned char*)calloc(bitmap->tiles_x * bitmap->tiles_y, 1);
+        if (s.tile_done == NULL) {
+            bitmap_allocation_failed("the fill");
+        } else if (s.value != 0) {
+            s.solid = tile_create_solid(s.value);
+        }
+        if (s.tile_done == NULL || (s.value != 0 && s.solid == NULL)) {
+            free(s.tile_done);
+            free(s.visited);
+            return;
+        }
+    }
+
+    fill_push(&s, x, x, y);
+    while (s.span_count > 0 || s.tile_count > 0) {
+        if (s.tile_count > 0) {
+            fill_tile_neighbours(&s, s.tiles[--s.tile_count]);
+            continue;
+        }
+        FillSpan span = s.spans[--s.span_count];
+        x = fill_find(&s, span.x1, span.x2, span.y);
+        while (x <= span.x2) {
+            int left = fill_scan_left(&s, x, span.y) + 1;
+            int right = fill_scan_right(&s, x, span.y) - 1;
+            fill_span(&s, left, right, span.y);
+            fill_push(&s, left, right, span.y - 1);
+            fill_push(&s, left, right, span.y + 1);
+            x = fill_find(&s, right + 2, span.x2, span.y);
+        }
+    }
+
+    bitmap_mark_dirty(bitmap, s.filled);
+    tile_release(s.solid);
+    free(s.spans);
+    free(s.tiles);
+    free(s.tile_done);
+    free(s.visited);
 }
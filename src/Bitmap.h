@@ -1,6 +1,17 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <atomic>
+#include <cstddef>
+
+// Tiled bitmaps are split into square RGBA tiles of this many pixels per side.
+// Tiles that have never been written are left unallocated and read as fully
+// transparent, so memory follows the painted area rather than the canvas size.
+#define TILE_SIZE 64
+#define TILE_SHIFT 6
+#define TILE_MASK (TILE_SIZE - 1)
+#define TILE_BYTES (TILE_SIZE * TILE_SIZE * 4)
+
 struct Color {
     unsigned char r;
     unsigned char g;
@@ -8,25 +19,92 @@ struct Color {
     unsigned char a;
 };
 
+struct Rect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+enum BitmapStorage {
+    STORAGE_FLAT,
+    STORAGE_TILED,
+};
+
+// How colour channels are stored. Premultiplied bitmaps hold each channel
+// already multiplied by alpha, which turns compositing into one multiply-add
+// per channel. Colors passed to and returned from the bitmap functions are
+// always straight.
+enum PixelFormat {
+    PIXEL_STRAIGHT,
+    PIXEL_PREMULTIPLIED,
+};
+
+// Tiles are shared between copies of a bitmap and only duplicated when one of
+// the sharing bitmaps writes to them. The count is atomic since worker threads
+// copy and release tiles that other bitmaps may share.
+struct Tile {
+    unsigned char data[TILE_BYTES];
+    std::atomic<int> refcount;
+};
+
 struct Bitmap {
-    unsigned char *data;
+    unsigned char *data; // Flat storage only, NULL for tiled bitmaps
     int width;
     int height;
-    int size;
+    size_t size; // Bytes of pixels, width * height * 4, which can exceed 2 GB
+    BitmapStorage storage;
+    PixelFormat format; // Set right after creating the bitmap; pixels are never converted
+    Tile **tiles; // Tiled storage only, tiles_x * tiles_y entries, NULL when unallocated
+    int tiles_x;
+    int tiles_y;
+    Rect dirty; // Everything drawn since the last bitmap_take_dirty()
+    Rect content; // Bounds everything that isn't transparent. Grows as the bitmap is drawn on.
 };
 
+// The create and copy functions print an error and return an empty (0 x 0)
+// bitmap when there isn't enough memory
 Bitmap bitmap_create(int width, int height);
-Bitmap bitmap_create_rotated(Bitmap *old);
-Bitmap bitmap_create_flipped_horizontal(Bitmap *old);
-Bitmap bitmap_create_flipped_vertical(Bitmap *old);
+Bitmap bitmap_create_tiled(int width, int height);
+Bitmap bitmap_copy(Bitmap *original);
+Bitmap bitmap_copy_region(Bitmap *original, Rect r);
+Bitmap bitmap_create_rotated(Bitmap *old, int degrees);
+// Flips in place, returning false and leaving the bitmap as it was when
+// there isn't enough memory
+bool bitmap_flip_horizontal(Bitmap *bitmap);
+bool bitmap_flip_vertical(Bitmap *bitmap);
+void bitmap_downsample(Bitmap *bitmap, Bitmap *source, Rect r);
 void bitmap_free(Bitmap *bitmap);
+Rect bitmap_take_dirty(Bitmap *bitmap);
 bool bitmap_get_pixel(Bitmap *bitmap, int x, int y, Color *color);
 bool bitmap_blend_pixel(Bitmap *bitmap, int x, int y, Color color);
 bool bitmap_blend(Bitmap *bitmap, Bitmap *other, int offset_x, int offset_y);
+bool bitmap_blend_rect(Bitmap *bitmap, Bitmap *other, int offset_x, int offset_y, Rect clip);
 bool bitmap_draw_pixel(Bitmap *bitmap, int x, int y, Color color);
+void bitmap_stamp(Bitmap *bitmap, const unsigned char *mask, int width, int height, int stride, int x, int y, Color color);
+void bitmap_erase_stamp(Bitmap *bitmap, const unsigned char *mask, int width, int height, int stride, int x, int y);
+void bitmap_write_pixels(Bitmap *bitmap, int x, int y, int width, int height, const unsigned char *src, int stride);
+void bitmap_read_pixels(Bitmap *bitmap, int x, int y, int width, int height, unsigned char *dst, int stride);
 void bitmap_draw_line(Bitmap *bitmap, int x1, int y1, int x2, int y2, Color color);
-void bitmap_fill(Bitmap *bitmap, int x, int y, Color color);
+void bitmap_draw_line_aa(Bitmap *bitmap, int x1, int y1, int x2, int y2, Color color, bool skip_start);
+void bitmap_fill_rect(Bitmap *bitmap, Rect rect, Color color);
+void bitmap_clear_rect(Bitmap *bitmap, Rect rect);
+void bitmap_fill(Bitmap *bitmap, int x, int y, Color color, int tolerance);
+
+Tile *tile_create();
+bool bitmap_take_allocation_failure();
+void tile_retain(Tile *tile);
+void tile_release(Tile *tile);
+void bitmap_set_tile(Bitmap *bitmap, int index, Tile *tile);
 
 bool color_eq(Color c1, Color c2);
+Color color_premultiply(Color color);
+Color color_unpremultiply(Color color);
+
+bool rect_is_empty(Rect r);
+Rect rect_union(Rect a, Rect b);
+Rect rect_intersect(Rect a, Rect b);
+Rect rect_offset(Rect r, int dx, int dy);
+Rect rect_downscale(Rect r, int shift);
 
 #endif // BITMAP_H
@@ -0,0 +1,337 @@
+#include <cstring>
+
+#include "Blend.h"
+
+// Straight-alpha "over" compositing in integer math:
+//
+//   da' = da * (255 - sa) / 255
+//   oa  = sa + da'
+//   oc  = (sc * sa + dc * da') / oa
+//
+// Every product and sum stays below 65536, so the SIMD kernels work on 16 bit
+// lanes and only widen to float for the final division. Pixels with zero source
+// alpha are left untouched, and the kernels agree with the scalar one within
+// one LSB (they may round exact halves differently).
+//
+// Premultiplied pixels need no division at all: oc = sc + dc * (255 - sa) / 255
+// for every channel, alpha included.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLEND_HAVE_X86
+#include <immintrin.h>
+#endif
+
+static inline int div255(int x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static void blend_span_scalar(unsigned char *dst, const unsigned char *src, int count) {
+    for (int i = 0; i < count * 4; i += 4) {
+        int sa = src[i + 3];
+        // The common cases are 0 or full alpha, so make those fast
+        if (sa == 0) {
+            continue;
+        }
+        if (sa == 255) {
+            memcpy(dst + i, src + i, 4);
+            continue;
+        }
+
+        int da = div255(dst[i + 3] * (255 - sa));
+        int oa = sa + da;
+        for (int c = 0; c < 3; c++) {
+            dst[i + c] = (unsigned char)((src[i + c] * sa + dst[i + c] * da + oa / 2) / oa);
+        }
+        dst[i + 3] = (unsigned char)oa;
+    }
+}
+
+static void blend_span_premultiplied_scalar(unsigned char *dst, const unsigned char *src, int count) {
+    for (int i = 0; i < count * 4; i += 4) {
+        int sa = src[i + 3];
+        if (sa == 0) {
+            continue;
+        }
+        if (sa == 255) {
+            memcpy(dst + i, src + i, 4);
+            continue;
+        }
+
+        for (int c = 0; c < 4; c++) {
+            int v = src[i + c] + div255(dst[i + c] * (255 - sa));
+            dst[i + c] = (unsigned char)(v > 255 ? 255 : v);
+        }
+    }
+}
+
+#ifdef BLEND_HAVE_X86
+
+__attribute__((target("sse2")))
+static inline __m128i div255_epu16(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Scales two pixels widened to 16 bits per channel by 255 minus the alpha of
+// the matching pixels in `s`
+__attribute__((target("sse2")))
+static inline __m128i scale_inverse_alpha_sse2(__m128i d, __m128i s) {
+    __m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+    return div255_epu16(_mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), sa)));
+}
+
+__attribute__((target("sse2")))
+static void blend_span_premultiplied_sse2(unsigned char *dst, const unsigned char *src, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        __m128i sa = _mm_and_si128(s, alpha);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xffff) {
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, alpha)) == 0xffff) {
+            _mm_storeu_si128((__m128i *)(dst + i * 4), s);
+            continue;
+        }
+
+        // Transparent source pixels scale by 255, which leaves dst as it was
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i * 4));
+        __m128i lo = scale_inverse_alpha_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero));
+        __m128i hi = scale_inverse_alpha_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero));
+        __m128i out = _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+        _mm_storeu_si128((__m128i *)(dst + i * 4), out);
+    }
+    blend_span_premultiplied_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+// Divides the 32 bit lanes of `num` by those of `den` (at least 1), rounding
+__attribute__((target("sse2")))
+static inline __m128i divide_epi32(__m128i num, __m128i den) {
+    __m128 q = _mm_div_ps(_mm_cvtepi32_ps(num), _mm_cvtepi32_ps(den));
+    return _mm_cvttps_epi32(_mm_add_ps(q, _mm_set1_ps(0.5f)));
+}
+
+// Blends two pixels widened to 16 bits per channel
+__attribute__((target("sse2")))
+static inline __m128i blend_pixels_sse2(__m128i s, __m128i d) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+
+    __m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+    __m128i da = _mm_shufflehi_epi16(_mm_shufflelo_epi16(d, 0xff), 0xff);
+    da = div255_epu16(_mm_mullo_epi16(da, _mm_sub_epi16(_mm_set1_epi16(255), sa)));
+    __m128i oa = _mm_add_epi16(sa, da);
+    __m128i num = _mm_add_epi16(_mm_mullo_epi16(s, sa), _mm_mullo_epi16(d, da));
+
+    __m128i den = _mm_max_epi16(oa, _mm_set1_epi16(1));
+    __m128i lo = divide_epi32(_mm_unpacklo_epi16(num, zero), _mm_unpacklo_epi16(den, zero));
+    __m128i hi = divide_epi32(_mm_unpackhi_epi16(num, zero), _mm_unpackhi_epi16(den, zero));
+    __m128i out = _mm_packs_epi32(lo, hi);
+    return _mm_or_si128(_mm_andnot_si128(alpha_lanes, out), _mm_and_si128(alpha_lanes, oa));
+}
+
+__attribute__((target("sse2")))
+static void blend_span_sse2(unsigned char *dst, const unsigned char *src, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        __m128i sa = _mm_and_si128(s, alpha);
+        __m128i transparent = _mm_cmpeq_epi32(sa, zero);
+        int transparent_mask = _mm_movemask_epi8(transparent);
+        if (transparent_mask == 0xffff) {
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, alpha)) == 0xffff) {
+            _mm_storeu_si128((__m128i *)(dst + i * 4), s);
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i * 4));
+        __m128i lo = blend_pixels_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = blend_pixels_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        __m128i out = _mm_packus_epi16(lo, hi);
+        out = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, out));
+        _mm_storeu_si128((__m128i *)(dst + i * 4), out);
+    }
+    blend_span_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i div255_epu16_avx2(__m256i x) {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i divide_epi32_avx2(__m256i num, __m256i den) {
+    __m256 q = _mm256_div_ps(_mm256_cvtepi32_ps(num), _mm256_cvtepi32_ps(den));
+    return _mm256_cvttps_epi32(_mm256_add_ps(q, _mm256_set1_ps(0.5f)));
+}
+
+// Same as blend_pixels_sse2, for two pixels in each 128 bit half. Every step
+// stays within its half, so the halves never need to be exchanged.
+__attribute__((target("avx2")))
+static inline __m256i blend_pixels_avx2(__m256i s, __m256i d) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_lanes = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+
+    __m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xff), 0xff);
+    __m256i da = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(d, 0xff), 0xff);
+    da = div255_epu16_avx2(_mm256_mullo_epi16(da, _mm256_sub_epi16(_mm256_set1_epi16(255), sa)));
+    __m256i oa = _mm256_add_epi16(sa, da);
+    __m256i num = _mm256_add_epi16(_mm256_mullo_epi16(s, sa), _mm256_mullo_epi16(d, da));
+
+    __m256i den = _mm256_max_epi16(oa, _mm256_set1_epi16(1));
+    __m256i lo = divide_epi32_avx2(_mm256_unpacklo_epi16(num, zero), _mm256_unpacklo_epi16(den, zero));
+    __m256i hi = divide_epi32_avx2(_mm256_unpackhi_epi16(num, zero), _mm256_unpackhi_epi16(den, zero));
+    __m256i out = _mm256_packs_epi32(lo, hi);
+    return _mm256_or_si256(_mm256_andnot_si256(alpha_lanes, out), _mm256_and_si256(alpha_lanes, oa));
+}
+
+__attribute__((target("avx2")))
+static void blend_span_avx2(unsigned char *dst, const unsigned char *src, int count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        __m256i sa = _mm256_and_si256(s, alpha);
+        __m256i transparent = _mm256_cmpeq_epi32(sa, zero);
+        if (_mm256_movemask_epi8(transparent) == -1) {
+            continue;
+        }
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, alpha)) == -1) {
+            _mm256_storeu_si256((__m256i *)(dst + i * 4), s);
+            continue;
+        }
+
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i * 4));
+        __m256i lo = blend_pixels_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+        __m256i hi = blend_pixels_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+        __m256i out = _mm256_packus_epi16(lo, hi);
+        out = _mm256_blendv_epi8(out, d, transparent);
+        _mm256_storeu_si256((__m256i *)(dst + i * 4), out);
+    }
+    blend_span_sse2(dst + i * 4, src + i * 4, count - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i scale_inverse_alpha_avx2(__m256i d, __m256i s) {
+    __m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xff), 0xff);
+    return div255_epu16_avx2(_mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(255), sa)));
+}
+
+__attribute__((target("avx2")))
+static void blend_span_premultiplied_avx2(unsigned char *dst, const unsigned char *src, int count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        __m256i sa = _mm256_and_si256(s, alpha);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, zero)) == -1) {
+            continue;
+        }
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, alpha)) == -1) {
+            _mm256_storeu_si256((__m256i *)(dst + i * 4), s);
+            continue;
+        }
+
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i * 4));
+        __m256i lo = scale_inverse_alpha_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero));
+        __m256i hi = scale_inverse_alpha_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero));
+        __m256i out = _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi));
+        _mm256_storeu_si256((__m256i *)(dst + i * 4), out);
+    }
+    blend_span_premultiplied_sse2(dst + i * 4, src + i * 4, count - i);
+}
+
+#endif // BLEND_HAVE_X86
+
+typedef void (*BlendSpanFunc)(unsigned char *dst, const unsigned char *src, int count);
+
+struct BlendKernel {
+    const char *name;
+    BlendSpanFunc straight;
+    BlendSpanFunc premultiplied;
+};
+
+static BlendKernel blend_select_kernel() {
+#ifdef BLEND_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return BlendKernel { "AVX2", blend_span_avx2, blend_span_premultiplied_avx2 };
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return BlendKernel { "SSE2", blend_span_sse2, blend_span_premultiplied_sse2 };
+    }
+#endif
+    return BlendKernel { "scalar", blend_span_scalar, blend_span_premultiplied_scalar };
+}
+
+static const BlendKernel &blend_kernel() {
+    static const BlendKernel kernel = blend_select_kernel();
+    return kernel;
+}
+
+void blend_span(unsigned char *dst, const unsigned char *src, int count) {
+    blend_kernel().straight(dst, src, count);
+}
+
+void blend_span_premultiplied(unsigned char *dst, const unsigned char *src, int count) {
+    blend_kernel().premultiplied(dst, src, count);
+}
+
+// The masked blends expand the mask into a short run of source pixels and
+// hand it to the regular kernels, so they get the same SIMD paths
+#define MASKED_CHUNK 64
+
+void blend_span_masked(unsigned char *dst, const unsigned char *mask, Color color, PixelFormat format, int count) {
+    unsigned char src[MASKED_CHUNK * 4];
+    for (int start = 0; start < count; start += MASKED_CHUNK) {
+        int n = count - start < MASKED_CHUNK ? count - start : MASKED_CHUNK;
+        const unsigned char *m = mask + start;
+        if (format == PIXEL_PREMULTIPLIED) {
+            Color c = color_premultiply(color);
+            for (int i = 0; i < n; i++) {
+                src[i * 4] = (unsigned char)div255(c.r * m[i]);
+                src[i * 4 + 1] = (unsigned char)div255(c.g * m[i]);
+                src[i * 4 + 2] = (unsigned char)div255(c.b * m[i]);
+                src[i * 4 + 3] = (unsigned char)div255(c.a * m[i]);
+            }
+            blend_kernel().premultiplied(dst + start * 4, src, n);
+        } else {
+            for (int i = 0; i < n; i++) {
+                src[i * 4] = color.r;
+                src[i * 4 + 1] = color.g;
+                src[i * 4 + 2] = color.b;
+                src[i * 4 + 3] = (unsigned char)div255(color.a * m[i]);
+            }
+            blend_kernel().straight(dst + start * 4, src, n);
+        }
+    }
+}
+
+void erase_span_masked(unsigned char *dst, const unsigned char *mask, PixelFormat format, int count) {
+    // Straight pixels only lose alpha, premultiplied ones scale every channel
+    int first = format == PIXEL_PREMULTIPLIED ? 0 : 3;
+    for (int i = 0; i < count; i++) {
+        int keep = 255 - mask[i];
+        for (int c = first; c < 4; c++) {
+            dst[i * 4 + c] = (unsigned char)div255(dst[i * 4 + c] * keep);
+        }
+    }
+}
+
+const char *blend_kernel_name() {
+    return blend_kernel().name;
+}
@@ -0,0 +1,23 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include "Bitmap.h"
+
+// Composites `count` straight-alpha RGBA pixels from `src` over `dst` in place,
+// using the widest kernel the CPU supports
+void blend_span(unsigned char *dst, const unsigned char *src, int count);
+
+// Same for premultiplied pixels, where over is src + dst * (1 - src alpha)
+void blend_span_premultiplied(unsigned char *dst, const unsigned char *src, int count);
+
+// Blends a solid straight-alpha `color` through an 8 bit coverage mask onto
+// `count` pixels stored in `format`
+void blend_span_masked(unsigned char *dst, const unsigned char *mask, Color color, PixelFormat format, int count);
+
+// Scales `count` pixels towards transparent by their mask coverage
+void erase_span_masked(unsigned char *dst, const unsigned char *mask, PixelFormat format, int count);
+
+// Name of the kernels blend_span() and blend_span_premultiplied() dispatch to
+const char *blend_kernel_name();
+
+#endif // BLEND_H
@@ -0,0 +1,168 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "Brush.h"
+#include "common.h"
+
+// Coverage of a pixel whose centre is at distance `d` from the tip's centre,
+// where `d` is 1 on the tip's outline. The inner `hardness` part is solid, the
+// rest fades out smoothly, and the outline is antialiased over `pixel`, the
+// size of one pixel in the same units.
+static float brush_coverage(float d, float pixel, float hardness) {
+    float edge = (d - 1) / pixel + 0.5f;
+    float coverage = edge <= 0 ? 1.0f : edge >= 1 ? 0.0f : 1.0f - edge;
+    if (d > hardness && hardness < 1) {
+        float t = MIN(1.0f, (d - hardness) / (1 - hardness));
+        coverage *= 1.0f - t * t * (3 - 2 * t);
+    }
+    return coverage;
+}
+
+BrushMask brush_mask_create(BrushTip tip, int offset_x, int offset_y) {
+    int size = MAX(tip.size, 1);
+    int width = size + 1;
+    int height = size + 1;
+    unsigned char *alpha = (unsigned char*)malloc((size_t)width * height);
+    if (alpha == NULL) {
+        printf("Not enough memory for a %d x %d brush mask\n", width, height);
+        return BrushMask { tip, offset_x, offset_y, 0, 0, NULL, 0 };
+    }
+
+    float radius = size / 2.0f;
+    float radius_y = MAX(radius * tip.roundness, 0.5f);
+    float cx = radius + (float)offset_x / BRUSH_SUBPIXEL_STEPS;
+    float cy = radius + (float)offset_y / BRUSH_SUBPIXEL_STEPS;
+    float c = cosf(tip.angle * (float)M_PI / 180.0f);
+    float s = sinf(tip.angle * (float)M_PI / 180.0f);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            // Rotate the pixel into the tip's frame, then scale the ellipse to a unit circle
+            float dx = x + 0.5f - cx;
+            float dy = y + 0.5f - cy;
+            float u = (dx * c + dy * s) / radius;
+            float v = (dy * c - dx * s) / radius_y;
+            float coverage = brush_coverage(sqrtf(u * u + v * v), 1.0f / radius_y, tip.hardness);
+            alpha[y * width + x] = (unsigned char)(coverage * tip.opacity + 0.5f);
+        }
+    }
+    return BrushMask { tip, offset_x, offset_y, width, height, alpha, 0 };
+}
+
+void brush_mask_free(BrushMask *mask) {
+    free(mask->alpha);
+    mask->alpha = NULL;
+}
+
+BrushCache brush_cache_create() {
+    BrushCache cache = {};
+    return cache;
+}
+
+void brush_cache_free(BrushCache *cache) {
+    for (int i = 0; i < cache->count; i++) {
+        brush_mask_free(&cache->masks[i]);
+    }
+    cache->count = 0;
+}
+
+static bool brush_tip_eq(BrushTip a, BrushTip b) {
+    return a.size == b.size
+        && a.hardness == b.hardness
+        && a.angle == b.angle
+        && a.roundness == b.roundness
+        && a.opacity == b.opacity;
+}
+
+// Returns the mask for the tip at the given subpixel offset, rasterizing it
+// in place of the least recently used one if it isn't cached. Returns NULL
+// when there isn't enough memory to rasterize it.
+BrushMask *brush_cache_get(BrushCache *cache, BrushTip tip, int offset_x, int offset_y) {
+    cache->clock++;
+    int oldest = 0;
+    for (int i = 0; i < cache->count; i++) {
+        BrushMask *mask = &cache->masks[i];
+        if (mask->offset_x == offset_x && mask->offset_y == offset_y && brush_tip_eq(mask->tip, tip)) {
+            mask->last_used = cache->clock;
+            cache->hits++;
+            return mask;
+        }
+        if (mask->last_used < cache->masks[oldest].last_used) {
+            oldest = i;
+        }
+    }
+
+    cache->misses++;
+    int index = oldest;
+    if (cache->count < BRUSH_CACHE_SIZE) {
+        index = cache->count++;
+    } else {
+        brush_mask_free(&cache->masks[index]);
+    }
+    BrushMask mask = brush_mask_create(tip, offset_x, offset_y);
+    if (mask.alpha == NULL) {
+        // Leave the slot empty so the mask is retried on the next dab
+        cache->masks[index] = cache->masks[--cache->count];
+        return NULL;
+    }
+    cache->masks[index] = mask;
+    cache->masks[index].last_used = cache->clock;
+    return &cache->masks[index];
+}
+
+BrushStroke brush_stroke_begin() {
+    return BrushStroke { false, 0, 0, 0 };
+}
+
+static void brush_dab(Bitmap *bitmap, BrushCache *cache, BrushTip tip, float x, float y, Color color, BrushMode mode) {
+    // (x, y) is a pixel, so the tip is centred on that pixel's centre. The
+    // fraction left over after placing the mask picks its subpixel variant.
+    float fx = x + 0.5f - MAX(tip.size, 1) / 2.0f;
+    float fy = y + 0.5f - MAX(tip.size, 1) / 2.0f;
+    int left = (int)floorf(fx);
+    int top = (int)floorf(fy);
+    int offset_x = (int)((fx - left) * BRUSH_SUBPIXEL_STEPS + 0.5f);
+    int offset_y = (int)((fy - top) * BRUSH_SUBPIXEL_STEPS + 0.5f);
+    if (offset_x == BRUSH_SUBPIXEL_STEPS) {
+        left++;
+        offset_x = 0;
+    }
+    if (offset_y == BRUSH_SUBPIXEL_STEPS) {
+        top++;
+        offset_y = 0;
+    }
+
+    BrushMask *mask = brush_cache_get(cache, tip, offset_x, offset_y);
+    if (mask == NULL) {
+        return;
+    }
+    if (mode == BRUSH_ERASE) {
+        bitmap_erase_stamp(bitmap, mask->alpha, mask->width, mask->height, mask->width, left, top);
+    } else {
+        bitmap_stamp(bitmap, mask->alpha, mask->width, mask->height, mask->width, left, top, color);
+    }
+}
+
+// Continues the stroke to (x, y), stamping a dab every `spacing` times the
+// brush size (at least one pixel). The first call stamps at its position.
+void brush_stroke_to(BrushStroke *stroke, Bitmap *bitmap, BrushCache *cache, BrushTip tip, float x, float y, float spacing, Color color, BrushMode mode) {
+    if (!stroke->started) {
+        brush_dab(bitmap, cache, tip, x, y, color, mode);
+        *stroke = BrushStroke { true, x, y, 0 };
+        return;
+    }
+
+    float step = MAX(1.0f, spacing * tip.size);
+    float dx = x - stroke->x;
+    float dy = y - stroke->y;
+    float length = sqrtf(dx * dx + dy * dy);
+    float position = step - stroke->distance;
+    while (position <= length) {
+        float t = position / length;
+        brush_dab(bitmap, cache, tip, stroke->x + dx * t, stroke->y + dy * t, color, mode);
+        position += step;
+    }
+    stroke->distance = length - (position - step);
+    stroke->x = x;
+    stroke->y = y;
+}
@@ -0,0 +1,70 @@
+#ifndef BRUSH_H
+#define BRUSH_H
+
+#include "Bitmap.h"
+
+// Distance between dabs as a fraction of the brush size
+#define BRUSH_DEFAULT_SPACING 0.1f
+
+// Number of rasterized tips kept by a BrushCache
+#define BRUSH_CACHE_SIZE 32
+
+// Dab positions are rounded to this fraction of a pixel, with a separate mask
+// for each offset
+#define BRUSH_SUBPIXEL_STEPS 4
+
+// Shape of a brush tip. Tips are ellipses `roundness` times as tall as they
+// are wide, rotated by `angle` degrees.
+struct BrushTip {
+    int size; // Diameter in pixels
+    float hardness; // 1 is a hard edge, 0 fades out from the centre
+    float angle;
+    float roundness;
+    int opacity;
+};
+
+// Coverage of a brush tip, rasterized once and stamped along strokes. Masks
+// are one pixel larger than the tip so they can hold it at any subpixel offset.
+struct BrushMask {
+    BrushTip tip;
+    int offset_x; // Subpixel offset of the tip's centre, in BRUSH_SUBPIXEL_STEPS
+    int offset_y;
+    int width;
+    int height;
+    unsigned char *alpha; // width * height coverage values, opacity included
+    unsigned long long last_used;
+};
+
+// Least recently used masks are dropped once the cache is full
+struct BrushCache {
+    BrushMask masks[BRUSH_CACHE_SIZE];
+    int count;
+    unsigned long long clock;
+    unsigned long long hits;
+    unsigned long long misses;
+};
+
+enum BrushMode {
+    BRUSH_PAINT,
+    BRUSH_ERASE,
+};
+
+// Position along a stroke, so dabs stay evenly spaced across mouse events
+struct BrushStroke {
+    bool started;
+    float x;
+    float y;
+    float distance; // Travelled since the last dab
+};
+
+BrushMask brush_mask_create(BrushTip tip, int offset_x, int offset_y);
+void brush_mask_free(BrushMask *mask);
+
+BrushCache brush_cache_create();
+void brush_cache_free(BrushCache *cache);
+BrushMask *brush_cache_get(BrushCache *cache, BrushTip tip, int offset_x, int offset_y);
+
+BrushStroke brush_stroke_begin();
+void brush_stroke_to(BrushStroke *stroke, Bitmap *bitmap, BrushCache *cache, BrushTip tip, float x, float y, float spacing, Color color, BrushMode mode);
+
+#endif // BRUSH_H
@@ -0,0 +1,386 @@
+#include <climits>
+
+#include "lib/stb_ds.h"
+
+#include "Compositor.h"
+#include "common.h"
+
+static void composite_job_free(CompositeJob *job) {
+    for (int i = 0; i < arrlen(job->layers); i++) {
+        bitmap_free(&job->layers[i].bitmap);
+    }
+    arrfree(job->layers);
+    job->layers = NULL;
+}
+
+// Copies `r` of one tiled buffer into another. Tiles inside it are shared
+// rather than copied, until either buffer draws on them.
+static void buffer_copy_rect(Bitmap *dst, Bitmap *src, Rect r) {
+    if (rect_is_empty(r)) {
+        return;
+    }
+    unsigned char pixels[TILE_BYTES];
+    for (int ty = r.y >> TILE_SHIFT; ty <= (r.y + r.height - 1) >> TILE_SHIFT; ty++) {
+        for (int tx = r.x >> TILE_SHIFT; tx <= (r.x + r.width - 1) >> TILE_SHIFT; tx++) {
+            Rect tile = rect_intersect(Rect { tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE }, Rect { 0, 0, src->width, src->height });
+            Rect part = rect_intersect(tile, r);
+            if (part.width == tile.width && part.height == tile.height) {
+                bitmap_set_tile(dst, ty * src->tiles_x + tx, src->tiles[ty * src->tiles_x + tx]);
+            } else {
+                bitmap_read_pixels(src, part.x, part.y, part.width, part.height, pixels, TILE_SIZE * 4);
+                bitmap_write_pixels(dst, part.x, part.y, part.width, part.height, pixels, TILE_SIZE * 4);
+            }
+        }
+    }
+}
+
+static Bitmap *compositor_level(Compositor *c, int buffer, int level) {
+    return level == 0 ? &c->buffers[buffer] : &c->levels[buffer][level - 1];
+}
+
+static void compositor_free_levels(Compositor *c) {
+    for (int i = 0; i < 2; i++) {
+        for (int level = 1; level < c->level_count; level++) {
+            bitmap_free(compositor_level(c, i, level));
+        }
+    }
+    c->level_count = 1;
+}
+
+// Flags the cells overlapping `r`. Cells are always composited after their
+// groups are rebuilt, so every flag implies CELL_COMPOSITE.
+static void compositor_mark_outdated(Compositor *c, Rect r, unsigned char flags) {
+    if (rect_is_empty(r)) {
+        return;
+    }
+    for (int y = r.y / COMPOSITOR_CELL_SIZE; y <= (r.y + r.height - 1) / COMPOSITOR_CELL_SIZE; y++) {
+        for (int x = r.x / COMPOSITOR_CELL_SIZE; x <= (r.x + r.width - 1) / COMPOSITOR_CELL_SIZE; x++) {
+            c->outdated[y * c->cells_x + x] |= flags | CELL_COMPOSITE;
+        }
+    }
+}
+
+// Returns the outdated cells in the viewport and counts them as composited.
+// Where those cells need the groups rebuilt is added to `below` and `above`.
+static Rect compositor_take_visible(Compositor *c, Rect *below, Rect *above) {
+    Rect canvas = { 0, 0, c->buffers[0].width, c->buffers[0].height };
+    Rect visible = rect_intersect(c->viewport, canvas);
+    Rect taken = { 0, 0, 0, 0 };
+    if (rect_is_empty(visible)) {
+        return taken;
+    }
+    for (int y = visible.y / COMPOSITOR_CELL_SIZE; y <= (visible.y + visible.height - 1) / COMPOSITOR_CELL_SIZE; y++) {
+        for (int x = visible.x / COMPOSITOR_CELL_SIZE; x <= (visible.x + visible.width - 1) / COMPOSITOR_CELL_SIZE; x++) {
+            unsigned char flags = c->outdated[y * c->cells_x + x];
+            if (flags == 0) {
+                continue;
+            }
+            c->outdated[y * c->cells_x + x] = 0;
+            Rect cell = rect_intersect(Rect { x * COMPOSITOR_CELL_SIZE, y * COMPOSITOR_CELL_SIZE, COMPOSITOR_CELL_SIZE, COMPOSITOR_CELL_SIZE }, canvas);
+            taken = rect_union(taken, cell);
+            if (flags & CELL_BELOW) {
+                *below = rect_union(*below, cell);
+            }
+            if (flags & CELL_ABOVE) {
+                *above = rect_union(*above, cell);
+            }
+        }
+    }
+    return taken;
+}
+
+// Flattens the group's layers again over `r`
+static void compositor_rebuild_group(Bitmap *group, CompositeLayer *layers, int count, Rect r) {
+    if (rect_is_empty(r)) {
+        return;
+    }
+    bitmap_clear_rect(group, r);
+    for (int i = 0; i < count; i++) {
+        bitmap_blend_rect(group, &layers[i].bitmap, layers[i].x, layers[i].y, r);
+    }
+}
+
+// Identifies the layers in a group and where they sit
+static unsigned long long layer_group_key(unsigned long long key, Layer **layers, int count) {
+    for (int i = 0; i < count; i++) {
+        key = (key ^ (unsigned)layers[i]->id) * 1099511628211ULL;
+        key = (key ^ (unsigned)layers[i]->x) * 1099511628211ULL;
+        key = (key ^ (unsigned)layers[i]->y) * 1099511628211ULL;
+    }
+    return (key ^ (unsigned)count) * 1099511628211ULL;
+}
+
+static void compositor_run(Compositor *c) {
+    std::unique_lock<std::mutex> guard(c->lock);
+    for (;;) {
+        c->wake.wait(guard, [c] { return c->quit || (c->has_pending && c->state == COMPOSITOR_IDLE); });
+        if (c->quit) {
+            return;
+        }
+        CompositeJob job = c->pending;
+        c->has_pending = false;
+        c->state = COMPOSITOR_BUSY;
+        Rect stale = c->stale;
+        c->stale = Rect { 0, 0, 0, 0 };
+        int back_index = 1 - c->front;
+        Bitmap *front = &c->buffers[c->front];
+        Bitmap *back = &c->buffers[back_index];
+        guard.unlock();
+
+        compositor_rebuild_group(&c->below, job.layers, job.first_active, job.rebuild_below);
+        compositor_rebuild_group(&c->above, job.layers + job.first_above, arrlen(job.layers) - job.first_above, job.rebuild_above);
+
+        // Swaps only happen while the worker is idle, so the front buffer
+        // stays put while the back one catches up with it
+        buffer_copy_rect(back, front, stale);
+        bitmap_clear_rect(back, job.dirty);
+        bitmap_blend_rect(back, &c->below, 0, 0, job.dirty);
+        for (int i = job.first_active; i < job.first_above; i++) {
+            CompositeLayer *layer = &job.layers[i];
+            bitmap_blend_rect(back, &layer->bitmap, layer->x, layer->y, job.dirty);
+        }
+        bitmap_blend_rect(back, &c->above, 0, 0, job.dirty);
+        composite_job_free(&job);
+
+        // The smaller levels are behind wherever the full size buffer was
+        Rect changed = rect_union(stale, job.dirty);
+        for (int level = 1; level < c->level_count; level++) {
+            changed = rect_downscale(changed, 1);
+            bitmap_downsample(compositor_level(c, back_index, level), compositor_level(c, back_index, level - 1), changed);
+        }
+
+        guard.lock();
+        c->finished = rect_union(c->finished, job.dirty);
+        c->back_sequence = job.sequence;
+        c->state = COMPOSITOR_READY;
+        c->done.notify_all();
+    }
+}
+
+Compositor *compositor_create() {
+    Compositor *c = new Compositor();
+    c->buffers[0] = bitmap_create_tiled(0, 0);
+    c->buffers[1] = bitmap_create_tiled(0, 0);
+    c->below = bitmap_create_tiled(0, 0);
+    c->above = bitmap_create_tiled(0, 0);
+    c->level_count = 1;
+    c->viewport = Rect { 0, 0, INT_MAX, INT_MAX };
+    c->thread = std::thread(compositor_run, c);
+    return c;
+}
+
+void compositor_free(Compositor *c) {
+    {
+        std::lock_guard<std::mutex> guard(c->lock);
+        c->quit = true;
+    }
+    c->wake.notify_all();
+    c->thread.join();
+    if (c->has_pending) {
+        composite_job_free(&c->pending);
+    }
+    compositor_free_levels(c);
+    bitmap_free(&c->buffers[0]);
+    bitmap_free(&c->buffers[1]);
+    bitmap_free(&c->below);
+    bitmap_free(&c->above);
+    arrfree(c->outdated);
+    delete c;
+}
+
+bool compositor_resize(Compositor *c, int width, int height, PixelFormat format) {
+    std::unique_lock<std::mutex> guard(c->lock);
+    if (c->width == width && c->height == height && c->buffers[c->front].format == format) {
+        return false;
+    }
+    c->done.wait(guard, [c] { return c->state != COMPOSITOR_BUSY; });
+    if (c->has_pending) {
+        composite_job_free(&c->pending);
+        c->has_pending = false;
+    }
+    compositor_free_levels(c);
+    c->width = width;
+    c->height = height;
+    c->out_of_memory = false;
+    for (int i = 0; i < 2; i++) {
+        bitmap_free(&c->buffers[i]);
+        c->buffers[i] = bitmap_create_tiled(c->out_of_memory ? 0 : width, c->out_of_memory ? 0 : height);
+        c->buffers[i].format = format;
+        c->out_of_memory = c->buffers[i].width != width;
+    }
+    int level_width = width;
+    int level_height = height;
+    while (!c->out_of_memory && c->level_count < COMPOSITOR_MAX_LEVELS && MAX(level_width, level_height) > COMPOSITOR_MIN_LEVEL_SIZE) {
+        level_width = (level_width + 1) / 2;
+        level_height = (level_height + 1) / 2;
+        for (int i = 0; i < 2; i++) {
+            Bitmap *level = compositor_level(c, i, c->level_count);
+            *level = bitmap_create_tiled(c->out_of_memory ? 0 : level_width, c->out_of_memory ? 0 : level_height);
+            level->format = format;
+            c->out_of_memory = level->width != level_width;
+        }
+        c->level_count++;
+    }
+    if (c->out_of_memory) {
+        // Whatever did fit is no use without the rest
+        compositor_free_levels(c);
+        for (int i = 0; i < 2; i++) {
+            bitmap_free(&c->buffers[i]);
+            c->buffers[i] = bitmap_create_tiled(0, 0);
+            c->buffers[i].format = format;
+        }
+        width = 0;
+        height = 0;
+    }
+    // The groups are empty tiled bitmaps until the next submit rebuilds them
+    bitmap_free(&c->below);
+    bitmap_free(&c->above);
+    c->below = bitmap_create_tiled(width, height);
+    c->above = bitmap_create_tiled(width, height);
+    c->below.format = format;
+    c->above.format = format;
+    c->below_valid = false;
+    c->above_valid = false;
+    c->cells_x = (width + COMPOSITOR_CELL_SIZE - 1) / COMPOSITOR_CELL_SIZE;
+    arrsetlen(c->outdated, c->cells_x * ((height + COMPOSITOR_CELL_SIZE - 1) / COMPOSITOR_CELL_SIZE));
+    for (int i = 0; i < arrlen(c->outdated); i++) {
+        c->outdated[i] = 0;
+    }
+    c->front = 0;
+    c->state = COMPOSITOR_IDLE;
+    c->finished = Rect { 0, 0, 0, 0 };
+    c->stale = Rect { 0, 0, 0, 0 };
+    return true;
+}
+
+bool compositor_out_of_memory(Compositor *c) {
+    std::lock_guard<std::mutex> guard(c->lock);
+    return c->out_of_memory;
+}
+
+void compositor_submit(Compositor *c, Layer **layers, int count, int first_active, int first_above, Rect dirty) {
+    std::lock_guard<std::mutex> guard(c->lock);
+    if (c->out_of_memory) {
+        return;
+    }
+    Rect canvas = { 0, 0, c->buffers[0].width, c->buffers[0].height };
+    dirty = rect_intersect(dirty, canvas);
+    // Each group is only flattened again when the layers in it changed, and
+    // then only where it comes into view, like everything else
+    unsigned long long below_key = layer_group_key(0, layers, first_active);
+    unsigned long long above_key = layer_group_key(0, layers + first_above, count - first_above);
+    if (!c->below_valid || below_key != c->below_key) {
+        compositor_mark_outdated(c, canvas, CELL_BELOW);
+    }
+    if (!c->above_valid || above_key != c->above_key) {
+        compositor_mark_outdated(c, canvas, CELL_ABOVE);
+    }
+    c->below_key = below_key;
+    c->above_key = above_key;
+    c->below_valid = true;
+    c->above_valid = true;
+    compositor_mark_outdated(c, dirty, CELL_COMPOSITE);
+    Rect rebuild_below = { 0, 0, 0, 0 };
+    Rect rebuild_above = { 0, 0, 0, 0 };
+    dirty = compositor_take_visible(c, &rebuild_below, &rebuild_above);
+    if (rect_is_empty(dirty)) {
+        return;
+    }
+    if (c->has_pending) {
+        // A job that hasn't started yet is replaced by one covering both regions
+        dirty = rect_union(dirty, c->pending.dirty);
+        rebuild_below = rect_union(rebuild_below, c->pending.rebuild_below);
+        rebuild_above = rect_union(rebuild_above, c->pending.rebuild_above);
+        composite_job_free(&c->pending);
+    }
+
+    // Groups are only needed where they are rebuilt, and the active group
+    // only over the dirty region
+    CompositeLayer *snapshots = NULL;
+    int job_first_active = 0;
+    int job_first_above = 0;
+    for (int i = 0; i < count; i++) {
+        bool active = i >= first_active && i < first_above;
+        Rect needed = active ? dirty : i < first_active ? rebuild_below : rebuild_above;
+        if (rect_is_empty(needed)) {
+            continue;
+        }
+        Rect region = rect_offset(needed, -layers[i]->x, -layers[i]->y);
+        CompositeLayer layer = { bitmap_copy_region(&layers[i]->bitmap, region), layers[i]->x, layers[i]->y };
+        arrput(snapshots, layer);
+        if (i < first_active) {
+            job_first_active++;
+        }
+        if (i < first_above) {
+            job_first_above++;
+        }
+    }
+    c->pending = CompositeJob { snapshots, rebuild_below, rebuild_above, job_first_active, job_first_above, dirty, ++c->submitted };
+    c->has_pending = true;
+    c->wake.notify_one();
+}
+
+static Rect compositor_swap_locked(Compositor *c) {
+    if (c->state != COMPOSITOR_READY) {
+        return Rect { 0, 0, 0, 0 };
+    }
+    Rect swapped = c->finished;
+    c->front = 1 - c->front;
+    c->front_sequence = c->back_sequence;
+    c->stale = swapped;
+    c->finished = Rect { 0, 0, 0, 0 };
+    c->state = COMPOSITOR_IDLE;
+    c->wake.notify_one();
+    return swapped;
+}
+
+Rect compositor_swap(Compositor *c) {
+    std::lock_guard<std::mutex> guard(c->lock);
+    return compositor_swap_locked(c);
+}
+
+Rect compositor_finish(Compositor *c) {
+    std::unique_lock<std::mutex> guard(c->lock);
+    Rect swapped = { 0, 0, 0, 0 };
+    for (;;) {
+        c->done.wait(guard, [c] { return c->state != COMPOSITOR_BUSY; });
+        swapped = rect_union(swapped, compositor_swap_locked(c));
+        if (!c->has_pending) {
+            return swapped;
+        }
+        c->done.wait(guard, [c] { return c->state == COMPOSITOR_READY; });
+    }
+}
+
+Bitmap *compositor_front(Compositor *c) {
+    return &c->buffers[c->front];
+}
+
+Bitmap *compositor_front_level(Compositor *c, int level) {
+    return compositor_level(c, c->front, level);
+}
+
+int compositor_level_count(Compositor *c) {
+    return c->level_count;
+}
+
+void compositor_invalidate(Compositor *c) {
+    std::lock_guard<std::mutex> guard(c->lock);
+    c->below_valid = false;
+    c->above_valid = false;
+}
+
+void compositor_set_viewport(Compositor *c, Rect viewport) {
+    std::lock_guard<std::mutex> guard(c->lock);
+    c->viewport = viewport;
+}
+
+unsigned long long compositor_submitted(Compositor *c) {
+    std::lock_guard<std::mutex> guard(c->lock);
+    return c->submitted;
+}
+
+unsigned long long compositor_front_sequence(Compositor *c) {
+    std::lock_guard<std::mutex> guard(c->lock);
+    return c->front_sequence;
+}
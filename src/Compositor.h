@@ -0,0 +1,142 @@
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "Bitmap.h"
+#include "Image.h"
+
+// Each buffer is also kept scaled down by powers of two, for drawing the
+// canvas zoomed out. Levels are added until the canvas fits in
+// COMPOSITOR_MIN_LEVEL_SIZE pixels per side, up to COMPOSITOR_MAX_LEVELS in
+// all, the full size buffer included.
+#define COMPOSITOR_MAX_LEVELS 8
+#define COMPOSITOR_MIN_LEVEL_SIZE 256
+
+// Size of the cells the compositor tracks out of date parts of the canvas in
+#define COMPOSITOR_CELL_SIZE 256
+
+// What is out of date in a cell
+#define CELL_COMPOSITE 1 // Changed but not composited yet
+#define CELL_BELOW 2 // The flattened group below has to be rebuilt there first
+#define CELL_ABOVE 4
+
+// A layer as it was when a job was queued. The bitmap shares the layer's tiles
+// over the job's region, so the GUI thread can keep drawing on the layer
+// while the worker reads the snapshot.
+struct CompositeLayer {
+    Bitmap bitmap;
+    int x;
+    int y;
+};
+
+struct CompositeJob {
+    CompositeLayer *layers; // stb_ds array, bottom to top
+    Rect rebuild_below; // Where layers[0, first_active), the group below, are flattened again
+    Rect rebuild_above; // Where layers[first_above, ...), the group above, are
+    int first_active; // layers[first_active, first_above) are the active group
+    int first_above;
+    Rect dirty;
+    unsigned long long sequence; // Of the latest submit merged into the job
+};
+
+enum CompositorState {
+    COMPOSITOR_IDLE,
+    COMPOSITOR_BUSY, // The worker is writing to the back buffer
+    COMPOSITOR_READY, // The back buffer holds finished work waiting to be swapped in
+};
+
+// Composites layers on a dedicated worker thread into the back one of two
+// buffers. The GUI thread only reads the front buffer, and swaps the two once
+// a job is done, so neither thread waits for the other while drawing.
+// Jobs queued while the worker is busy are merged into one.
+//
+// Layers are split into three groups: those below the active layer, the
+// active group (the active layer and whatever is previewed on it), and those
+// above. The outer two are kept flattened, so redrawing part of a stroke
+// blends three bitmaps however many layers there are.
+//
+// Only the part of the canvas in the viewport is composited, and the groups
+// are only flattened again there. Changes elsewhere are remembered and
+// handled once they come into view.
+struct Compositor {
+    std::thread thread;
+    std::mutex lock; // Guards everything below except the buffers' pixels
+    std::condition_variable wake;
+    std::condition_variable done;
+    int width; // Canvas size, which the buffers have unless allocating them failed
+    int height;
+    bool out_of_memory; // Buffers are empty, so submits do nothing
+    Bitmap buffers[2];
+    Bitmap levels[2][COMPOSITOR_MAX_LEVELS - 1]; // Each buffer at 1/2, 1/4 and so on
+    int level_count; // Including the full size buffers
+    int front;
+    CompositorState state;
+    bool has_pending;
+    CompositeJob pending;
+    Rect finished; // Composited into the back buffer since the last swap
+    Rect stale; // Part of the back buffer that is older than the front
+    unsigned long long submitted; // Number of submits so far
+    unsigned long long back_sequence; // Latest submit composited into each buffer
+    unsigned long long front_sequence;
+    Bitmap below; // Flattened groups, owned by the worker thread
+    Bitmap above;
+    unsigned long long below_key; // Which layers, where, went into the last queued rebuild of each group
+    unsigned long long above_key;
+    bool below_valid;
+    bool above_valid;
+    Rect viewport;
+    unsigned char *outdated; // stb_ds array of CELL_ flags, one per cell
+    int cells_x;
+    bool quit;
+};
+
+Compositor *compositor_create();
+void compositor_free(Compositor *compositor);
+
+// Reallocates both buffers if the canvas size or format changed, dropping
+// any queued work. Returns true if it did, in which case everything has to
+// be composited again. The buffers and their levels are tiled, so tiles are
+// only allocated where something has been composited. If even the buffers'
+// tile tables don't fit in memory, the buffers are left empty until the next
+// resize, and compositor_out_of_memory() returns true.
+bool compositor_resize(Compositor *compositor, int width, int height, PixelFormat format);
+bool compositor_out_of_memory(Compositor *compositor);
+
+// Queues compositing `dirty` from `count` layers, bottom to top, with
+// layers[first_active, first_above) as the active group. The layers are
+// snapshotted right away, so they may be drawn on as soon as this returns.
+// Only the active group may have changed since the last submit, unless the
+// groups are invalidated or the layers in them are different or have moved.
+void compositor_submit(Compositor *compositor, Layer **layers, int count, int first_active, int first_above, Rect dirty);
+
+// Rebuilds the flattened groups with the next submit, for when the pixels of
+// layers outside the active group changed
+void compositor_invalidate(Compositor *compositor);
+
+// Sets the part of the canvas submits composite. Whatever changed outside it
+// is composited by the first submit after it comes into view, which may have
+// an empty dirty region.
+void compositor_set_viewport(Compositor *compositor, Rect viewport);
+
+// If finished work is waiting, swaps it to the front and returns the region
+// that changed; otherwise returns an empty rectangle
+Rect compositor_swap(Compositor *compositor);
+
+// Waits for all queued work, then swaps it in like compositor_swap()
+Rect compositor_finish(Compositor *compositor);
+
+Bitmap *compositor_front(Compositor *compositor);
+
+// The front buffer scaled down by 2^level. Level 0 is the front buffer itself.
+Bitmap *compositor_front_level(Compositor *compositor, int level);
+int compositor_level_count(Compositor *compositor);
+
+// Submits are numbered from 1. Once the front buffer includes the one
+// compositor_submitted() returned, compositor_front_sequence() reaches it.
+unsigned long long compositor_submitted(Compositor *compositor);
+unsigned long long compositor_front_sequence(Compositor *compositor);
+
+#endif // COMPOSITOR_H
@@ -0,0 +1,134 @@
+#include <cstring>
+
+#include "Compress.h"
+#include "common.h"
+
+// A small LZ77 compressor using the LZ4 block layout. Each sequence is a token
+// byte holding the literal count in its high nibble and the match length in
+// its low nibble (both extended by 255-terminated bytes when they reach 15),
+// followed by the literals and a 16 bit little endian match offset. The last
+// sequence only has literals.
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+#define MAX_OFFSET 65535
+
+static inline unsigned read32(const unsigned char *p) {
+    unsigned v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline unsigned hash32(unsigned v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static unsigned char *write_length(unsigned char *op, int length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+static unsigned char *write_literals(unsigned char *op, const unsigned char *literals, int count, int match) {
+    *op++ = (unsigned char)((MIN(count, 15) << 4) | MIN(match, 15));
+    if (count >= 15) {
+        op = write_length(op, count - 15);
+    }
+    memcpy(op, literals, count);
+    return op + count;
+}
+
+// Compresses `size` bytes into `dst`, which must hold COMPRESS_BOUND(size)
+// bytes. Returns the compressed size.
+int compress(const unsigned char *src, int size, unsigned char *dst) {
+    int table[1 << HASH_BITS];
+    for (int i = 0; i < (1 << HASH_BITS); i++) {
+        table[i] = -1;
+    }
+
+    unsigned char *op = dst;
+    int anchor = 0;
+    int i = 0;
+    while (i + MIN_MATCH <= size) {
+        unsigned h = hash32(read32(src + i));
+        int candidate = table[h];
+        table[h] = i;
+        if (candidate < 0 || i - candidate > MAX_OFFSET || read32(src + candidate) != read32(src + i)) {
+            i++;
+            continue;
+        }
+
+        int match = MIN_MATCH;
+        while (i + match < size && src[candidate + match] == src[i + match]) {
+            match++;
+        }
+        int offset = i - candidate;
+        op = write_literals(op, src + anchor, i - anchor, match - MIN_MATCH);
+        *op++ = (unsigned char)(offset & 0xff);
+        *op++ = (unsigned char)(offset >> 8);
+        if (match - MIN_MATCH >= 15) {
+            op = write_length(op, match - MIN_MATCH - 15);
+        }
+        i += match;
+        anchor = i;
+    }
+    op = write_literals(op, src + anchor, size - anchor, 0);
+    return (int)(op - dst);
+}
+
+static bool read_length(const unsigned char *src, int size, int *ip, int *length) {
+    unsigned char b;
+    do {
+        if (*ip >= size) {
+            return false;
+        }
+        b = src[(*ip)++];
+        *length += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompresses into `dst`, which must be exactly as large as the original data.
+// Returns false for malformed input.
+bool decompress(const unsigned char *src, int size, unsigned char *dst, int dst_size) {
+    int ip = 0;
+    int op = 0;
+    while (ip < size) {
+        int token = src[ip++];
+        int literals = token >> 4;
+        if (literals == 15 && !read_length(src, size, &ip, &literals)) {
+            return false;
+        }
+        if (ip + literals > size || op + literals > dst_size) {
+            return false;
+        }
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == size) {
+            break;
+        }
+
+        if (ip + 2 > size) {
+            return false;
+        }
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int match = token & 15;
+        if (match == 15 && !read_length(src, size, &ip, &match)) {
+            return false;
+        }
+        match += MIN_MATCH;
+        if (offset == 0 || offset > op || op + match > dst_size) {
+            return false;
+        }
+        // Matches may overlap their own output, so copy byte by byte
+        for (int k = 0; k < match; k++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op == dst_size;
+}
@@ -0,0 +1,10 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// Largest output compress() can produce for `size` bytes of input
+#define COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+int compress(const unsigned char *src, int size, unsigned char *dst);
+bool decompress(const unsigned char *src, int size, unsigned char *dst, int dst_size);
+
+#endif // COMPRESS_H
@@ -7,11 +7,16 @@
 #include <QFormLayout>
 #include <QHBoxLayout>
 #include <QSpacerItem>
+#include <QInputDialog>
+
+#include <climits>
 
 #include <lib/stb_ds.h>
 
 #include "common.h"
+#include "Blend.h"
 #include "Image.h"
+#include "Parallel.h"
 #include "Editor.h"
 
 Q_DECLARE_METATYPE(QDockWidget::DockWidgetFeatures)
@@ -37,30 +42,31 @@ static void initializeImageFileDialog(QFileDialog *dialog, QFileDialog::AcceptMo
         dialog->setDefaultSuffix("png");
 }
 
-static Layer layerFromQImage(QImage image) {
+// Qt 5 addresses a QImage's pixels with an int, so images of more than 2 GB
+// can't be read or saved through one
+static bool fitsInQImage(int width, int height) {
+    return (qint64)width * height * 4 <= INT_MAX;
+}
+
+// Images are converted to the layer's pixel format here, and back in
+// Editor::saveFile(), so nothing in between has to convert pixels
+static Layer layerFromQImage(QImage image, PixelFormat format) {
     if (!image.isNull()) {
 
-        image = image.convertToFormat(QImage::Format_RGBA8888);
-        int width = image.width();
-        int height = image.height();
-        Bitmap bitmap = bitmap_create(width, height);
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                QRgb c = image.pixel(x, y);
-                Color color = {
-                    (unsigned char)qRed(c),
-                    (unsigned char)qGreen(c),
-                    (unsigned char)qBlue(c),
-                    (unsigned char)qAlpha(c),
-                };
-                bitmap_draw_pixel(&bitmap, x, y, color);
-            }
+        image = image.convertToFormat(format == PIXEL_PREMULTIPLIED
+                ? QImage::Format_RGBA8888_Premultiplied
+                : QImage::Format_RGBA8888);
+        Bitmap bitmap = bitmap_create_tiled(image.width(), image.height());
+        bitmap.format = format;
+        if (bitmap.width != image.width()) {
+            return layer_create_from_bitmap("Unnamed Layer", 0, 0, bitmap);
         }
+        bitmap_write_pixels(&bitmap, 0, 0, image.width(), image.height(), image.constBits(), image.bytesPerLine());
 
         Layer layer = layer_create_from_bitmap("Unnamed Layer", 100, 100, bitmap);
         return layer;
     }
-    return layer_create("Unnamed Layer", 0, 0, 0, 0);
+    return layer_create("Unnamed Layer", 0, 0, 0, 0, format);
 }
 
 Editor::Editor() {
@@ -192,15 +198,30 @@ Editor::Editor() {
     copyAction->setShortcut(QKeySequence::Copy);
     pasteAction = editMenu->addAction(tr("&Paste"), this, &Editor::paste);
     pasteAction->setShortcut(QKeySequence::Paste);
+    editMenu->addSeparator();
+    antialiasAction = editMenu->addAction(tr("&Antialiased Lines"));
+    antialiasAction->setCheckable(true);
+    connect(antialiasAction, &QAction::toggled, this, &Editor::setAntialiasEnabled);
+    threadsAction = editMenu->addAction(tr("Worker &Threads..."), this, &Editor::setThreadCount);
 
     QMenu *viewMenu = menuBar()->addMenu(tr("&View"));
     zoomInAction = viewMenu->addAction(tr("Zoom &In (25%)"), this, &Editor::zoomIn);
     zoomInAction->setShortcut(QKeySequence::ZoomIn);
     zoomOutAction = viewMenu->addAction(tr("Zoom &Out (25%)"), this, &Editor::zoomOut);
     zoomOutAction->setShortcut(QKeySequence::ZoomOut);
+    viewMenu->addSeparator();
+    gpuCompositingAction = viewMenu->addAction(tr("&GPU Compositing"));
+    gpuCompositingAction->setCheckable(true);
+    connect(gpuCompositingAction, &QAction::toggled, this, &Editor::setGpuCompositing);
+    renderStatisticsAction = viewMenu->addAction(tr("Render &Statistics"), this, &Editor::showRenderStatistics);
 
     QMenu *imageMenu = menuBar()->addMenu(tr("&Image"));
+    premultiplyAction = imageMenu->addAction(tr("&Premultiplied Alpha for New Images"));
+    premultiplyAction->setCheckable(true);
+    imageMenu->addSeparator();
     rotateAction = imageMenu->addAction(tr("&Rotate 90 degrees"), this, &Editor::rotate);
+    rotate180Action = imageMenu->addAction(tr("Rotate &180 degrees"), this, &Editor::rotate180);
+    rotateCounterClockwiseAction = imageMenu->addAction(tr("Rotate 90 degrees &Counter-clockwise"), this, &Editor::rotateCounterClockwise);
     flipHorizontalAction = imageMenu->addAction(tr("Flip &Horizontal"), this, &Editor::flipHorizontal);
     flipVerticalAction = imageMenu->addAction(tr("Flip &Vertical"), this, &Editor::flipVertical);
 
@@ -215,6 +236,18 @@ Editor::Editor() {
     createFile(800, 600);
 }
 
+void Editor::setAntialiasEnabled(bool enabled) {
+    for (int i = 0; i < tabs->count(); i++) {
+        static_cast<ImageWidget*>(tabs->widget(i))->antialiasEnabled = enabled;
+    }
+}
+
+void Editor::setGpuCompositing(bool enabled) {
+    for (int i = 0; i < tabs->count(); i++) {
+        static_cast<ImageWidget*>(tabs->widget(i))->setGpuCompositing(enabled);
+    }
+}
+
 ImageWidget *Editor::activeTab() {
     return static_cast<ImageWidget*>(tabs->currentWidget());
 }
@@ -239,7 +272,9 @@ void Editor::layerListSelectionChanged() {
 
 void Editor::layerListModelUpdated(QStandardItem *item) {
     activeTab()->layerVisibilityMask[item->row()] = (item->checkState() == Qt::Checked);
-    activeTab()->updateTextures();
+    // The layer joins or leaves its group, which the compositor notices and
+    // flattens again, so nothing needs invalidating
+    activeTab()->updateTextures(Rect { 0, 0, activeTab()->image.width, activeTab()->image.height });
 }
 
 void Editor::newFile() {
@@ -266,20 +301,24 @@ void Editor::newFile() {
 
 void Editor::newLayer() {
     if (activeTab()->isImageInitialized) {
-        Layer layer = layer_create("Unnamed Layer", 0, 0, activeTab()->image.width, activeTab()->image.height);
+        Image *image = &activeTab()->image;
+        Layer layer = layer_create("Unnamed Layer", 0, 0, image->width, image->height, image->format);
         addLayer(layer);
     }
 }
 
 void Editor::createFile(int width, int height) {
     auto widget = new ImageWidget(this);
-    widget->image = image_create(width, height);
-    widget->tempLayer = layer_create("temp", 0, 0, width, height);
+    PixelFormat format = premultiplyAction->isChecked() ? PIXEL_PREMULTIPLIED : PIXEL_STRAIGHT;
+    widget->image = image_create(width, height, format);
+    widget->tempLayer = layer_create("temp", 0, 0, width, height, format);
     widget->isImageInitialized = true;
+    widget->antialiasEnabled = antialiasAction->isChecked();
+    widget->gpuCompositingEnabled = gpuCompositingAction->isChecked();
     widget->filename = "UNNAMED";
     tabs->addTab(widget, widget->filename);
     tabs->setCurrentWidget(widget);
-    Layer layer = layer_create("Unnamed Layer", 0, 0, width, height);
+    Layer layer = layer_create("Unnamed Layer", 0, 0, width, height, format);
     addLayer(layer);
 
     activeTab()->setVisible(true);
@@ -297,14 +336,27 @@ void Editor::open() {
         fileName = dialog.selectedFiles().at(0);
         QImageReader reader(fileName);
         reader.setAutoTransform(true);
+        QSize size = reader.size();
+        if (size.isValid() && !fitsInQImage(size.width(), size.height())) {
+            QMessageBox::warning(this, tr("Open Failed"),
+                    tr("\"%1\" is %2 x %3 pixels, which is more than the 2 GB an image can be opened as.")
+                    .arg(QDir::toNativeSeparators(fileName)).arg(size.width()).arg(size.height()));
+            return;
+        }
         QImage image = reader.read();
-        Layer layer = layerFromQImage(image);
+        if (image.isNull()) {
+            QMessageBox::warning(this, tr("Open Failed"),
+                    tr("Couldn't open \"%1\": %2").arg(QDir::toNativeSeparators(fileName), reader.errorString()));
+            return;
+        }
+        PixelFormat format = premultiplyAction->isChecked() ? PIXEL_PREMULTIPLIED : PIXEL_STRAIGHT;
+        Layer layer = layerFromQImage(image, format);
         if (layer.bitmap.width != 0) {
             if (activeTab()->isImageInitialized) {
                 image_free(activeTab()->image);
             }
-            activeTab()->image = image_create(800, 600);
-            activeTab()->tempLayer = layer_create("temp", 0, 0, 800, 600);
+            activeTab()->image = image_create(800, 600, format);
+            activeTab()->tempLayer = layer_create("temp", 0, 0, 800, 600, format);
             activeTab()->isImageInitialized = true;
             activeTab()->scaleFactor = 1.0;
             activeTab()->updateTextures();
@@ -316,6 +368,9 @@ void Editor::open() {
             saveAsAction->setEnabled(true);
             QString message = tr("Opened \"%1\"").arg(QDir::toNativeSeparators(fileName));
             statusBar()->showMessage(message);
+        } else {
+            QMessageBox::warning(this, tr("Open Failed"),
+                    tr("There isn't enough memory to open \"%1\".").arg(QDir::toNativeSeparators(fileName)));
         }
     }
 }
@@ -338,15 +393,41 @@ void Editor::saveAs() {
 }
 
 void Editor::undo() {
-    image_undo(&activeTab()->image, &activeTab()->hist);
+    if (!image_undo(&activeTab()->image, &activeTab()->hist)) {
+        // Includes running out of memory for its tiles, so that isn't reported twice
+        bitmap_take_allocation_failure();
+        QMessageBox::warning(this, tr("Undo Failed"),
+                tr("The step couldn't be read back from the history, so it wasn't undone."));
+        return;
+    }
+    activeTab()->fitTempLayer();
     activeTab()->updateTextures();
+    activeTab()->warnIfAllocationFailed();
     refreshLayerList();
+    showHistoryUsage();
 }
 
 void Editor::redo() {
-    image_redo(&activeTab()->image, &activeTab()->hist);
+    if (!image_redo(&activeTab()->image, &activeTab()->hist)) {
+        // Includes running out of memory for its tiles, so that isn't reported twice
+        bitmap_take_allocation_failure();
+        QMessageBox::warning(this, tr("Redo Failed"),
+                tr("The step couldn't be read back from the history, so it wasn't redone."));
+        return;
+    }
+    activeTab()->fitTempLayer();
     activeTab()->updateTextures();
+    activeTab()->warnIfAllocationFailed();
     refreshLayerList();
+    showHistoryUsage();
+}
+
+void Editor::showHistoryUsage() {
+    ImageHistory *hist = &activeTab()->hist;
+    QString message = tr("History: %1 MB in memory, %2 MB on disk")
+        .arg(image_history_memory_usage(hist) / (1024.0 * 1024.0), 0, 'f', 1)
+        .arg(image_history_disk_usage(hist) / (1024.0 * 1024.0), 0, 'f', 1);
+    statusBar()->showMessage(message);
 }
 
 void Editor::cut() {}
@@ -355,7 +436,7 @@ void Editor::copy() {}
 
 void Editor::paste() {
     QClipboard *clipboard = QApplication::clipboard();
-    Layer layer = layerFromQImage(clipboard->image());
+    Layer layer = layerFromQImage(clipboard->image(), activeTab()->image.format);
     if (layer.bitmap.width != 0) {
         addLayer(layer);
     }
@@ -369,6 +450,33 @@ void Editor::zoomOut() {
     activeTab()->scaleImage(0.8);
 }
 
+void Editor::showRenderStatistics() {
+    ImageWidget *tab = activeTab();
+    double averageLatency = tab->inputLatencySamples > 0 ? tab->totalInputLatency / tab->inputLatencySamples : 0;
+    QString message = tr("Frames: %1 rendered, %2 idle frames skipped. Blending: %3 on %4 threads. Brush cache: %5 hits, %6 misses. "
+            "Input to frame: %7 ms last, %8 ms average, %9 ms max. Layers composited on the %10")
+        .arg(tab->framesRendered)
+        .arg(tab->idleFramesSkipped)
+        .arg(blend_kernel_name())
+        .arg(parallel_thread_count())
+        .arg(tab->brushCache.hits)
+        .arg(tab->brushCache.misses)
+        .arg(tab->lastInputLatency, 0, 'f', 1)
+        .arg(averageLatency, 0, 'f', 1)
+        .arg(tab->maxInputLatency, 0, 'f', 1)
+        .arg(tab->gpuCompositingEnabled ? tr("GPU") : tr("CPU"));
+    statusBar()->showMessage(message);
+}
+
+void Editor::setThreadCount() {
+    bool ok;
+    int count = QInputDialog::getInt(this, tr("Worker Threads"), tr("Threads used for pixel operations:"),
+            parallel_thread_count(), 1, PARALLEL_MAX_THREADS, 1, &ok);
+    if (ok) {
+        parallel_set_thread_count(count);
+    }
+}
+
 void Editor::normalSize() {}
 
 void Editor::fitToWindow() {}
@@ -377,6 +485,14 @@ void Editor::rotate() {
     activeTab()->rotate(90);
 }
 
+void Editor::rotate180() {
+    activeTab()->rotate(180);
+}
+
+void Editor::rotateCounterClockwise() {
+    activeTab()->rotate(270);
+}
+
 void Editor::flipHorizontal() {
     activeTab()->flipHorizontal();
 }
@@ -429,6 +545,8 @@ void Editor::updateImageActions(bool enabled) {
     zoomInAction->setEnabled(enabled);
     zoomOutAction->setEnabled(enabled);
     rotateAction->setEnabled(enabled);
+    rotate180Action->setEnabled(enabled);
+    rotateCounterClockwiseAction->setEnabled(enabled);
     flipHorizontalAction->setEnabled(enabled);
     flipVerticalAction->setEnabled(enabled);
     addLayerAction->setEnabled(enabled);
@@ -447,15 +565,32 @@ void Editor::saveFile(QString filename) {
         write = (confirmation.exec() == QMessageBox::Yes);
     }
     if (write) {
+        int width = activeTab()->image.width;
+        int height = activeTab()->image.height;
+        if (!fitsInQImage(width, height)) {
+            QMessageBox::warning(this, tr("Save Failed"),
+                    tr("The image is %1 x %2 pixels, which is more than the 2 GB an image can be saved as.")
+                    .arg(width).arg(height));
+            return;
+        }
+        Bitmap *bitmap = activeTab()->finishCompositing();
+        if (bitmap->width != activeTab()->image.width || bitmap->height != activeTab()->image.height) {
+            QMessageBox::warning(this, tr("Save Failed"), tr("There isn't enough memory to save \"%1\".").arg(filename));
+            return;
+        }
+        // The composite is tiled, so it is gathered into one image to save it
         QImage image(
-                activeTab()->bitmap.data,
-                activeTab()->bitmap.width,
-                activeTab()->bitmap.height,
-                activeTab()->bitmap.width * 4,
-                QImage::Format_RGBA8888,
-                nullptr,
-                nullptr);
-        image.save(filename);
+                bitmap->width,
+                bitmap->height,
+                bitmap->format == PIXEL_PREMULTIPLIED ? QImage::Format_RGBA8888_Premultiplied : QImage::Format_RGBA8888);
+        if (image.isNull()) {
+            QMessageBox::warning(this, tr("Save Failed"), tr("There isn't enough memory to save \"%1\".").arg(filename));
+            return;
+        }
+        bitmap_read_pixels(bitmap, 0, 0, bitmap->width, bitmap->height, image.bits(), image.bytesPerLine());
+        if (!image.convertToFormat(QImage::Format_RGBA8888).save(filename)) {
+            QMessageBox::warning(this, tr("Save Failed"), tr("Couldn't save \"%1\".").arg(filename));
+        }
     }
 }
 
@@ -55,12 +55,18 @@ private slots:
     void paste();
     void zoomIn();
     void zoomOut();
+    void showRenderStatistics();
+    void setThreadCount();
     void normalSize();
     void fitToWindow();
     void rotate();
+    void rotate180();
+    void rotateCounterClockwise();
     void flipHorizontal();
     void flipVertical();
     void newLayer();
+    void setAntialiasEnabled(bool enabled);
+    void setGpuCompositing(bool enabled);
 
     void setActiveColor(Color color);
 
@@ -112,6 +118,7 @@ private:
     void addLayer(Layer layer);
     void updateImageActions(bool enabled);
     void saveFile(QString filename);
+    void showHistoryUsage();
 
     QAction *newAction;
     QAction *openAction;
@@ -123,11 +130,18 @@ private:
     QAction *cutAction;
     QAction *copyAction;
     QAction *pasteAction;
+    QAction *antialiasAction;
+    QAction *threadsAction;
     QAction *zoomInAction;
     QAction *zoomOutAction;
+    QAction *gpuCompositingAction;
+    QAction *renderStatisticsAction;
     QAction *normalSizeAction;
     QAction *fitToWindowAction;
+    QAction *premultiplyAction;
     QAction *rotateAction;
+    QAction *rotate180Action;
+    QAction *rotateCounterClockwiseAction;
     QAction *flipHorizontalAction;
     QAction *flipVerticalAction;
     QAction *addLayerAction;
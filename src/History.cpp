@@ -0,0 +1,490 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+
+#include "lib/stb_ds.h"
+
+#include "Compress.h"
+#include "History.h"
+
+static Layer *layers_copy(Layer *layers) {
+    Layer *copy = NULL;
+    for (int i = 0; i < arrlen(layers); i++) {
+        arrput(copy, layer_copy(&layers[i]));
+    }
+    return copy;
+}
+
+static void layers_free(Layer *layers) {
+    for (int i = 0; i < arrlen(layers); i++) {
+        layer_free(&layers[i]);
+    }
+    arrfree(layers);
+}
+
+static void history_entry_free(HistoryEntry *entry) {
+    layers_free(entry->before_layers);
+    layers_free(entry->after_layers);
+    for (int i = 0; i < arrlen(entry->tiles); i++) {
+        tile_release(entry->tiles[i].before);
+        tile_release(entry->tiles[i].after);
+    }
+    arrfree(entry->tiles);
+    arrfree(entry->moves);
+    arrfree(entry->compressed);
+}
+
+static bool history_entry_is_empty(HistoryEntry *entry) {
+    return !entry->is_structural && arrlen(entry->tiles) == 0 && arrlen(entry->moves) == 0;
+}
+
+// Whether both images have the same layers at the same sizes, in which case
+// their differences can be described tile by tile
+static bool image_same_structure(Image *a, Image *b) {
+    if (a->width != b->width || a->height != b->height || arrlen(a->layers) != arrlen(b->layers)) {
+        return false;
+    }
+    for (int i = 0; i < arrlen(a->layers); i++) {
+        Bitmap *ba = &a->layers[i].bitmap;
+        Bitmap *bb = &b->layers[i].bitmap;
+        if (a->layers[i].id != b->layers[i].id
+                || ba->width != bb->width
+                || ba->height != bb->height
+                || ba->storage != STORAGE_TILED
+                || bb->storage != STORAGE_TILED) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Tiles are only ever allocated inside a bitmap's content, so the tiles that
+// can differ between two bitmaps lie in the tile range of their contents.
+// Returns that range in tiles.
+static Rect content_tiles(Rect content) {
+    if (rect_is_empty(content)) {
+        return Rect { 0, 0, 0, 0 };
+    }
+    int x = content.x >> TILE_SHIFT;
+    int y = content.y >> TILE_SHIFT;
+    int right = (content.x + content.width - 1) >> TILE_SHIFT;
+    int bottom = (content.y + content.height - 1) >> TILE_SHIFT;
+    return Rect { x, y, right - x + 1, bottom - y + 1 };
+}
+
+// Bytes of tiles in `layers` that aren't shared with the same layer in `other`
+static size_t layers_unshared_bytes(Layer *layers, Layer *other) {
+    size_t bytes = 0;
+    for (int i = 0; i < arrlen(layers); i++) {
+        Bitmap *bitmap = &layers[i].bitmap;
+        if (bitmap->storage == STORAGE_FLAT) {
+            bytes += bitmap->size;
+            continue;
+        }
+        Bitmap *match = NULL;
+        for (int j = 0; j < arrlen(other); j++) {
+            Bitmap *candidate = &other[j].bitmap;
+            if (other[j].id == layers[i].id
+                    && candidate->storage == STORAGE_TILED
+                    && candidate->tiles_x == bitmap->tiles_x
+                    && candidate->tiles_y == bitmap->tiles_y) {
+                match = candidate;
+            }
+        }
+        Rect tiles = content_tiles(bitmap->content);
+        for (int ty = tiles.y; ty < tiles.y + tiles.height; ty++) {
+            for (int tx = tiles.x; tx < tiles.x + tiles.width; tx++) {
+                int t = ty * bitmap->tiles_x + tx;
+                if (bitmap->tiles[t] != NULL && (match == NULL || match->tiles[t] != bitmap->tiles[t])) {
+                    bytes += sizeof(Tile);
+                }
+            }
+        }
+    }
+    return bytes;
+}
+
+static HistoryEntry history_entry_create(Image *before, Image *after) {
+    HistoryEntry entry = {};
+    entry.before_width = before->width;
+    entry.before_height = before->height;
+    entry.after_width = after->width;
+    entry.after_height = after->height;
+
+    if (!image_same_structure(before, after)) {
+        entry.is_structural = true;
+        entry.before_layers = layers_copy(before->layers);
+        entry.after_layers = layers_copy(after->layers);
+        entry.bytes_applied = layers_unshared_bytes(entry.before_layers, entry.after_layers);
+        entry.bytes_undone = layers_unshared_bytes(entry.after_layers, entry.before_layers);
+        return entry;
+    }
+
+    for (int i = 0; i < arrlen(after->layers); i++) {
+        Layer *b = &before->layers[i];
+        Layer *a = &after->layers[i];
+        if (b->x != a->x || b->y != a->y) {
+            arrput(entry.moves, (LayerMove { i, b->x, b->y, a->x, a->y }));
+        }
+
+        // Writing to a shared tile replaces it, so every tile painted since the
+        // snapshot shows up as a different pointer.
+        Rect tiles = content_tiles(rect_union(b->bitmap.content, a->bitmap.content));
+        for (int ty = tiles.y; ty < tiles.y + tiles.height; ty++) {
+            for (int tx = tiles.x; tx < tiles.x + tiles.width; tx++) {
+                int t = ty * a->bitmap.tiles_x + tx;
+                Tile *tb = b->bitmap.tiles[t];
+                Tile *ta = a->bitmap.tiles[t];
+                if (tb != ta) {
+                    tile_retain(tb);
+                    tile_retain(ta);
+                    arrput(entry.tiles, (TileDelta { i, t, tb, ta }));
+                    entry.bytes_applied += tb != NULL ? sizeof(Tile) : 0;
+                    entry.bytes_undone += ta != NULL ? sizeof(Tile) : 0;
+                }
+            }
+        }
+    }
+    return entry;
+}
+
+// Collects the addresses of every tile pointer the entry holds, in a fixed order
+static Tile ***history_entry_tile_slots(HistoryEntry *entry) {
+    Tile ***slots = NULL;
+    for (int i = 0; i < arrlen(entry->tiles); i++) {
+        arrput(slots, &entry->tiles[i].before);
+        arrput(slots, &entry->tiles[i].after);
+    }
+    Layer *sides[2] = { entry->before_layers, entry->after_layers };
+    for (int side = 0; side < 2; side++) {
+        for (int i = 0; i < arrlen(sides[side]); i++) {
+            Bitmap *bitmap = &sides[side][i].bitmap;
+            for (int t = 0; t < bitmap->tiles_x * bitmap->tiles_y; t++) {
+                arrput(slots, &bitmap->tiles[t]);
+            }
+        }
+    }
+    return slots;
+}
+
+enum SlotKind {
+    SLOT_EMPTY,
+    SLOT_TILE,
+    SLOT_REPEAT, // Same tile as an earlier slot
+};
+
+static void blob_put(unsigned char **blob, const void *data, int size) {
+    memcpy(arraddnptr(*blob, size), data, size);
+}
+
+// Replaces the entry's tiles with one compressed blob. Tiles shared between
+// slots (e.g. the unchanged tiles of a structural entry) are stored once.
+static void history_entry_compress(HistoryEntry *entry) {
+    struct { Tile *key; int value; } *seen = NULL;
+    unsigned char buffer[COMPRESS_BOUND(TILE_BYTES)];
+    Tile ***slots = history_entry_tile_slots(entry);
+    unsigned char *blob = NULL;
+    for (int i = 0; i < arrlen(slots); i++) {
+        Tile *tile = *slots[i];
+        unsigned char kind = SLOT_EMPTY;
+        if (tile == NULL) {
+            blob_put(&blob, &kind, 1);
+            continue;
+        }
+        int index = (int)hmgeti(seen, tile);
+        if (index >= 0) {
+            kind = SLOT_REPEAT;
+            int repeat = seen[index].value;
+            blob_put(&blob, &kind, 1);
+            blob_put(&blob, &repeat, sizeof(int));
+        } else {
+            kind = SLOT_TILE;
+            int size = compress(tile->data, TILE_BYTES, buffer);
+            blob_put(&blob, &kind, 1);
+            blob_put(&blob, &size, sizeof(int));
+            blob_put(&blob, buffer, size);
+            hmput(seen, tile, i);
+        }
+        tile_release(tile);
+        *slots[i] = NULL;
+    }
+    hmfree(seen);
+    arrfree(slots);
+    entry->compressed = blob;
+    entry->compressed_size = arrlen(blob);
+    entry->storage = ENTRY_COMPRESSED;
+}
+
+// Reads back the tiles of history_entry_compress(). Every tile is checked
+// before any goes into the entry, so a blob that is damaged, or tiles that
+// can't be allocated, leave the entry compressed and return false.
+static bool history_entry_decompress(HistoryEntry *entry) {
+    Tile ***slots = history_entry_tile_slots(entry);
+    Tile **tiles = NULL;
+    const unsigned char *p = entry->compressed;
+    const unsigned char *end = p + entry->compressed_size;
+    bool ok = true;
+    for (int i = 0; i < arrlen(slots) && ok; i++) {
+        if (end - p < 1) {
+            ok = false;
+            break;
+        }
+        Tile *tile = NULL;
+        unsigned char kind = *p++;
+        if (kind != SLOT_EMPTY) {
+            int value;
+            if (end - p < (ptrdiff_t)sizeof(int)) {
+                ok = false;
+                break;
+            }
+            memcpy(&value, p, sizeof(int));
+            p += sizeof(int);
+            if (kind == SLOT_REPEAT && value >= 0 && value < i) {
+                tile = tiles[value];
+                tile_retain(tile);
+            } else if (kind == SLOT_TILE && value >= 0 && value <= end - p) {
+                tile = tile_create();
+                ok = tile != NULL && decompress(p, value, tile->data, TILE_BYTES);
+                p += value;
+            } else {
+                ok = false;
+            }
+        }
+        arrput(tiles, tile);
+    }
+    ok = ok && p == end;
+    if (!ok) {
+        printf("Failed to load history entry!\n");
+        for (int i = 0; i < arrlen(tiles); i++) {
+            tile_release(tiles[i]);
+        }
+    } else {
+        for (int i = 0; i < arrlen(slots); i++) {
+            *slots[i] = tiles[i];
+        }
+        arrfree(entry->compressed);
+        entry->compressed = NULL;
+        entry->compressed_size = 0;
+        entry->storage = ENTRY_RESIDENT;
+    }
+    arrfree(tiles);
+    arrfree(slots);
+    return ok;
+}
+
+static bool history_entry_spill(ImageHistory *hist, HistoryEntry *entry) {
+    if (hist->spill_file == NULL) {
+        hist->spill_file = tmpfile();
+        if (hist->spill_file == NULL) {
+            printf("Failed to create history spill file!\n");
+            return false;
+        }
+    }
+    // Space from entries that are loaded back or discarded isn't reused; the
+    // file is deleted when the history is freed.
+    fseek(hist->spill_file, 0, SEEK_END);
+    long offset = ftell(hist->spill_file);
+    if (fwrite(entry->compressed, 1, entry->compressed_size, hist->spill_file) != entry->compressed_size) {
+        printf("Failed to write history spill file!\n");
+        return false;
+    }
+    arrfree(entry->compressed);
+    entry->compressed = NULL;
+    entry->spill_offset = offset;
+    entry->storage = ENTRY_SPILLED;
+    return true;
+}
+
+static bool history_entry_unspill(ImageHistory *hist, HistoryEntry *entry) {
+    arrsetlen(entry->compressed, entry->compressed_size);
+    fseek(hist->spill_file, entry->spill_offset, SEEK_SET);
+    if (fread(entry->compressed, 1, entry->compressed_size, hist->spill_file) != entry->compressed_size) {
+        printf("Failed to read history spill file!\n");
+        arrfree(entry->compressed);
+        entry->compressed = NULL;
+        return false;
+    }
+    entry->storage = ENTRY_COMPRESSED;
+    return true;
+}
+
+// Makes the entry's tiles available again. Entries are only decompressed
+// when they are undone or redone. Returns false, leaving the entry where it
+// was stored, when it can't be read back.
+static bool history_entry_load(ImageHistory *hist, HistoryEntry *entry) {
+    if (entry->storage == ENTRY_SPILLED && !history_entry_unspill(hist, entry)) {
+        return false;
+    }
+    if (entry->storage == ENTRY_COMPRESSED) {
+        return history_entry_decompress(entry);
+    }
+    return true;
+}
+
+static size_t history_entry_memory_usage(ImageHistory *hist, int k) {
+    HistoryEntry *entry = &hist->entries[k];
+    switch (entry->storage) {
+        case ENTRY_RESIDENT:
+            return k < hist->idx ? entry->bytes_applied : entry->bytes_undone;
+        case ENTRY_COMPRESSED:
+            return entry->compressed_size;
+        default:
+            return 0;
+    }
+}
+
+// How many undos or redos away the entry is
+static int history_distance(ImageHistory *hist, int k) {
+    return k < hist->idx ? hist->idx - 1 - k : k - hist->idx;
+}
+
+static void history_enforce_budget(ImageHistory *hist) {
+    while (image_history_memory_usage(hist) > hist->budget) {
+        // Compress the entries furthest from the current position first, and
+        // only start spilling to disk once everything worth it is compressed
+        int candidate = -1;
+        EntryStorage storages[2] = { ENTRY_RESIDENT, ENTRY_COMPRESSED };
+        for (int s = 0; s < 2 && candidate < 0; s++) {
+            for (int k = 0; k < arrlen(hist->entries); k++) {
+                if (hist->entries[k].storage == storages[s]
+                        && history_entry_memory_usage(hist, k) > 0
+                        && (candidate < 0 || history_distance(hist, k) > history_distance(hist, candidate))) {
+                    candidate = k;
+                }
+            }
+        }
+        if (candidate < 0) {
+            break;
+        }
+        HistoryEntry *entry = &hist->entries[candidate];
+        if (entry->storage == ENTRY_RESIDENT) {
+            history_entry_compress(entry);
+        } else if (!history_entry_spill(hist, entry)) {
+            break;
+        }
+    }
+}
+
+// Puts the image into the state before (`undo`) or after the entry. The image
+// must currently be in the opposite state.
+static void history_entry_apply(HistoryEntry *entry, Image *image, bool undo) {
+    if (entry->is_structural) {
+        image_free(*image);
+        image->width = undo ? entry->before_width : entry->after_width;
+        image->height = undo ? entry->before_height : entry->after_height;
+        image->layers = layers_copy(undo ? entry->before_layers : entry->after_layers);
+        return;
+    }
+    for (int i = 0; i < arrlen(entry->tiles); i++) {
+        TileDelta *delta = &entry->tiles[i];
+        bitmap_set_tile(&image->layers[delta->layer].bitmap, delta->tile, undo ? delta->before : delta->after);
+    }
+    for (int i = 0; i < arrlen(entry->moves); i++) {
+        LayerMove *move = &entry->moves[i];
+        image->layers[move->layer].x = undo ? move->before_x : move->after_x;
+        image->layers[move->layer].y = undo ? move->before_y : move->after_y;
+    }
+}
+
+ImageHistory image_history_create() {
+    return ImageHistory {
+        NULL,
+        0,
+        image_create(0, 0, PIXEL_STRAIGHT),
+        false,
+        HISTORY_DEFAULT_BUDGET,
+        NULL,
+    };
+}
+
+void image_history_free(ImageHistory *hist) {
+    for (int i = 0; i < arrlen(hist->entries); i++) {
+        history_entry_free(&hist->entries[i]);
+    }
+    arrfree(hist->entries);
+    image_free(hist->base);
+    if (hist->spill_file != NULL) {
+        fclose(hist->spill_file);
+    }
+}
+
+void image_history_set_budget(ImageHistory *hist, size_t budget) {
+    hist->budget = budget;
+    history_enforce_budget(hist);
+}
+
+size_t image_history_memory_usage(ImageHistory *hist) {
+    size_t bytes = 0;
+    for (int k = 0; k < arrlen(hist->entries); k++) {
+        bytes += history_entry_memory_usage(hist, k);
+    }
+    return bytes;
+}
+
+size_t image_history_disk_usage(ImageHistory *hist) {
+    size_t bytes = 0;
+    for (int k = 0; k < arrlen(hist->entries); k++) {
+        if (hist->entries[k].storage == ENTRY_SPILLED) {
+            bytes += hist->entries[k].compressed_size;
+        }
+    }
+    return bytes;
+}
+
+void image_take_snapshot(Image *image, ImageHistory *hist) {
+    if (!hist->has_base) {
+        hist->base = image_copy(image);
+        hist->has_base = true;
+        return;
+    }
+
+    HistoryEntry entry = history_entry_create(&hist->base, image);
+    if (history_entry_is_empty(&entry)) {
+        history_entry_free(&entry);
+        return;
+    }
+
+    // A new change discards everything that could have been redone
+    while (arrlen(hist->entries) > hist->idx) {
+        history_entry_free(&arrlast(hist->entries));
+        arrpop(hist->entries);
+    }
+    arrput(hist->entries, entry);
+    hist->idx++;
+    history_entry_apply(&entry, &hist->base, false);
+    history_enforce_budget(hist);
+}
+
+// Undoing and redoing return false, and leave the image and history as they
+// were, when the entry can't be read back from its compressed or spilled form
+bool image_undo(Image *image, ImageHistory *hist) {
+    // Record anything that hasn't been snapshotted yet, so that the image is
+    // in the state after the newest entry
+    image_take_snapshot(image, hist);
+    if (hist->idx > 0) {
+        HistoryEntry *entry = &hist->entries[hist->idx - 1];
+        if (!history_entry_load(hist, entry)) {
+            return false;
+        }
+        hist->idx--;
+        history_entry_apply(entry, image, true);
+        history_entry_apply(entry, &hist->base, true);
+        history_enforce_budget(hist);
+    }
+    return true;
+}
+
+bool image_redo(Image *image, ImageHistory *hist) {
+    image_take_snapshot(image, hist);
+    if (hist->idx < arrlen(hist->entries)) {
+        HistoryEntry *entry = &hist->entries[hist->idx];
+        if (!history_entry_load(hist, entry)) {
+            return false;
+        }
+        history_entry_apply(entry, image, false);
+        history_entry_apply(entry, &hist->base, false);
+        hist->idx++;
+        history_enforce_budget(hist);
+    }
+    return true;
+}
@@ -0,0 +1,83 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <cstddef>
+#include <cstdio>
+
+#include "Bitmap.h"
+#include "Image.h"
+
+#define HISTORY_DEFAULT_BUDGET ((size_t)512 * 1024 * 1024)
+
+// A tile of one layer that changed between two snapshots
+struct TileDelta {
+    int layer;
+    int tile;
+    Tile *before;
+    Tile *after;
+};
+
+// A layer whose offset changed between two snapshots
+struct LayerMove {
+    int layer;
+    int before_x;
+    int before_y;
+    int after_x;
+    int after_y;
+};
+
+enum EntryStorage {
+    ENTRY_RESIDENT,
+    ENTRY_COMPRESSED,
+    ENTRY_SPILLED,
+};
+
+struct HistoryEntry {
+    // Changes to the layer stack itself (adding, removing or resizing layers)
+    // keep both versions of the whole stack. These share their tiles with the
+    // live image, so they only cost the tile tables.
+    bool is_structural;
+    int before_width;
+    int before_height;
+    int after_width;
+    int after_height;
+    Layer *before_layers;
+    Layer *after_layers;
+
+    // Everything else only records the tiles and offsets that changed
+    TileDelta *tiles;
+    LayerMove *moves;
+
+    // Entries far from the current position get their tiles compressed, and
+    // then moved to the history's spill file, to keep within its budget.
+    // Their tile pointers are NULL until they are loaded back.
+    EntryStorage storage;
+    unsigned char *compressed;
+    size_t compressed_size;
+    long spill_offset;
+
+    // Memory held by the entry's tiles that the image doesn't share, while the
+    // entry is applied and while it is undone
+    size_t bytes_applied;
+    size_t bytes_undone;
+};
+
+struct ImageHistory {
+    HistoryEntry *entries;
+    int idx; // Number of entries currently applied to the image
+    Image base; // The image as of the last snapshot
+    bool has_base;
+    size_t budget; // Bytes of memory the entries may use before being compressed or spilled
+    FILE *spill_file;
+};
+
+ImageHistory image_history_create();
+void image_history_free(ImageHistory *hist);
+void image_history_set_budget(ImageHistory *hist, size_t budget);
+size_t image_history_memory_usage(ImageHistory *hist);
+size_t image_history_disk_usage(ImageHistory *hist);
+void image_take_snapshot(Image *image, ImageHistory *hist);
+bool image_undo(Image *image, ImageHistory *hist);
+bool image_redo(Image *image, ImageHistory *hist);
+
+#endif // HISTORY_H
@@ -6,28 +6,31 @@
 
 #include "Image.h"
 
-Layer layer_create(const char *name, int x, int y, int width, int height) {
+static int next_layer_id = 1;
+
+Layer layer_create(const char *name, int x, int y, int width, int height, PixelFormat format) {
     char *my_name = (char*)malloc(strlen(name) + 1);
     strcpy(my_name, name);
 
-    Bitmap bitmap = bitmap_create(width, height);
+    Bitmap bitmap = bitmap_create_tiled(width, height);
+    bitmap.format = format;
 
-    Layer layer = { my_name, bitmap, x, y };
+    Layer layer = { my_name, bitmap, x, y, next_layer_id++ };
     return layer;
 }
 
+// The copy shares its pixel tiles with the original until either one writes
+// to them, so copying a layer costs memory proportional to what changes later.
 Layer layer_copy(Layer *original) {
     char *name = (char*)malloc(strlen(original->name) + 1);
     strcpy(name, original->name);
-    Bitmap bitmap = bitmap_create(original->bitmap.width, original->bitmap.height);
-    for (int i = 0; i < original->bitmap.size; i++) {
-        bitmap.data[i] = original->bitmap.data[i];
-    }
-    Layer layer = { name, bitmap, original->x, original->y };
+    Bitmap bitmap = bitmap_copy(&original->bitmap);
+    Layer layer = { name, bitmap, original->x, original->y, original->id };
     return layer;
 }
 
 void layer_free(Layer *layer) {
+    free(layer->name);
     bitmap_free(&layer->bitmap);
 }
 
@@ -35,14 +38,15 @@ Layer layer_create_from_bitmap(const char *name, int x, int y, Bitmap bitmap) {
     char *my_name = (char*)malloc(strlen(name) + 1);
     strcpy(my_name, name);
 
-    Layer layer = { my_name, bitmap, x, y };
+    Layer layer = { my_name, bitmap, x, y, next_layer_id++ };
     return layer;
 }
 
-Image image_create(int width, int height) {
+Image image_create(int width, int height, PixelFormat format) {
     return Image {
         width,
         height,
+        format,
         NULL,
     };
 }
@@ -55,6 +59,7 @@ Image image_copy(Image *original) {
     Image image = Image {
         original->width,
         original->height,
+        original->format,
         layers,
     };
     return image;
@@ -74,29 +79,3 @@ void image_add_layer(Image *image, Layer layer) {
 void image_remove_layer(Image *image, int id) {
     arrdel(image->layers, id);
 }
-
-void image_take_snapshot(Image *image, ImageHistory *hist) {
-
-    for (int i = arrlen(hist->snapshots) - 1; i > hist->idx; i--) {
-        image_free(hist->snapshots[i]);
-        arrpop(hist->snapshots);
-    }
-    arrput(hist->snapshots, image_copy(image));
-    hist->idx++;
-}
-
-void image_undo(Image *image, ImageHistory *hist) {
-    if (hist->idx > 0) {
-        hist->idx--;
-        image_free(*image);
-        *image = image_copy(&hist->snapshots[hist->idx]);
-    }
-}
-
-void image_redo(Image *image, ImageHistory *hist) {
-    if (hist->idx < arrlen(hist->snapshots) - 1) {
-        hist->idx++;
-        image_free(*image);
-        *image = image_copy(&hist->snapshots[hist->idx]);
-    }
-}
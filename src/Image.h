@@ -8,31 +8,25 @@ struct Layer {
     Bitmap bitmap;
     int x;
     int y;
+    int id; // Identifies the layer across copies, e.g. in the undo history
 };
 
 struct Image {
     int width;
     int height;
+    PixelFormat format; // Pixel format of every layer
     Layer *layers;
 };
 
-struct ImageHistory {
-    Image *snapshots;
-    int idx;
-};
-
-Layer layer_create(const char *name, int x, int y, int width, int height);
+Layer layer_create(const char *name, int x, int y, int width, int height, PixelFormat format);
 Layer layer_create_from_bitmap(const char *name, int x, int y, Bitmap bitmap);
 Layer layer_copy(Layer *original);
 void layer_free(Layer *layer);
 
-Image image_create(int width, int height);
+Image image_create(int width, int height, PixelFormat format);
 void image_free(Image image);
 Image image_copy(Image *original);
 void image_add_layer(Image *image, Layer layer);
 void image_remove_layer(int id);
-void image_take_snapshot(Image *image, ImageHistory *hist);
-void image_undo(Image *image, ImageHistory *hist);
-void image_redo(Image *image, ImageHistory *hist);
 
 #endif // IMAGE_H
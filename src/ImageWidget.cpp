@@ -1,5 +1,6 @@
 #include <QRandomGenerator>
 #include <math.h>
+#include <cstring>
 
 #include "lib/stb_ds.h"
 
@@ -13,6 +14,52 @@ ImageWidget::ImageWidget(QWidget *parent) {
     timer->setInterval(5);
     connect(timer, &QTimer::timeout, this, QOverload<>::of(&ImageWidget::useSprayCan));
     connect(this, SIGNAL(sendColorChanged(Color)), parent, SLOT(setActiveColor(Color)));
+
+    // Repaints are only scheduled when something visible changed, at most once per frame
+    frameTimer = new QTimer(this);
+    frameTimer->setInterval(FRAME_INTERVAL_MS);
+    connect(frameTimer, &QTimer::timeout, this, &ImageWidget::frameTick);
+}
+
+// Schedules a repaint for the next frame tick
+void ImageWidget::requestRepaint() {
+    needsRepaint = true;
+}
+
+void ImageWidget::frameTick() {
+    drainStrokeQueue();
+    updateViewport();
+    queueComposite(compositor_swap(compositor));
+    if (needsRepaint) {
+        needsRepaint = false;
+        update();
+    } else {
+        idleFramesSkipped++;
+    }
+}
+
+// Composites whatever changed off screen and has since scrolled into view
+void ImageWidget::updateViewport() {
+    Rect visible = visibleCanvasRect();
+    if (visible.x == compositeViewport.x && visible.y == compositeViewport.y
+            && visible.width == compositeViewport.width && visible.height == compositeViewport.height) {
+        return;
+    }
+    compositeViewport = visible;
+    compositor_set_viewport(compositor, visible);
+    if (!gpuCompositingEnabled) {
+        compositeLayers(Rect { 0, 0, 0, 0 });
+    }
+}
+
+void ImageWidget::showEvent(QShowEvent *event) {
+    QOpenGLWidget::showEvent(event);
+    frameTimer->start();
+}
+
+void ImageWidget::hideEvent(QHideEvent *event) {
+    QOpenGLWidget::hideEvent(event);
+    frameTimer->stop();
 }
 
 QPoint ImageWidget::globalToCanvas(QPoint g) {
@@ -32,7 +79,7 @@ QPoint ImageWidget::globalToCanvas(QPoint g) {
 
 void ImageWidget::scaleImage(double factor) {
     scaleFactor *= factor;
-    updateTextures();
+    requestRepaint();
 
     /* adjustScrollBar(horizontalScrollBar(), factor); */
     /* adjustScrollBar(verticalScrollBar(), factor); */
@@ -73,29 +120,33 @@ void ImageWidget::mousePressEvent(QMouseEvent *event) {
     mousePosition = event->globalPos();
     isMiddleButtonDown = ((event->button() & Qt::MidButton) == Qt::MidButton);
     isLeftButtonDown = ((event->button() & Qt::LeftButton) == Qt::LeftButton);
+    stroke = brush_stroke_begin();
+    pencilStarted = false;
 
-    applyTools(event);
+    strokePosition = event->globalPos();
+    arrput(strokeQueue, (StrokePoint { event->globalPos(), eTimer->nsecsElapsed() }));
+    drainStrokeQueue();
 
-    updateTextures();
+    updateTextures(takeDirtyRect());
     event->accept();
 }
 
 void ImageWidget::mouseReleaseEvent(QMouseEvent *event) {
+    // Finish drawing the stroke while the button still counts as down
+    drainStrokeQueue();
+
     isMiddleButtonDown = !((event->button() & Qt::MidButton) == Qt::MidButton);
     isLeftButtonDown = !((event->button() & Qt::LeftButton) == Qt::LeftButton);
-    
-    // Blend, then clear the temporary layer
-    bitmap_blend(&image.layers[activeLayerIndex].bitmap, &tempLayer.bitmap, 0, 0);
-    for (int y = 0; y < tempLayer.bitmap.height; y++) {
-        for (int x = 0; x < tempLayer.bitmap.width; x++) {
-            Color c = {0, 0, 0, 0};
-            bitmap_draw_pixel(&tempLayer.bitmap, x, y, c);
-        }
-    }
+
+    // Blend, then clear the temporary layer, only where it was drawn on
+    bitmap_blend_rect(&image.layers[activeLayerIndex].bitmap, &tempLayer.bitmap, 0, 0, tempLayerUsed);
+    clearTempLayer();
+    updateTextures(takeDirtyRect());
     if (!isLeftButtonDown) {
         image_take_snapshot(&image, &hist);
         timer->stop();
     }
+    warnIfAllocationFailed();
 }
 
 void ImageWidget::mouseMoveEvent(QMouseEvent *event) {
@@ -105,9 +156,13 @@ void ImageWidget::mouseMoveEvent(QMouseEvent *event) {
         QPoint diff = event->globalPos() - mousePosition;
         offsetX += diff.x();
         offsetY += diff.y();
+        requestRepaint();
     }
 
-    applyTools(event);
+    // Drawn on the next frame tick, so bursts of motion events cost one composite
+    if (isLeftButtonDown) {
+        arrput(strokeQueue, (StrokePoint { event->globalPos(), eTimer->nsecsElapsed() }));
+    }
 
     lastMousePosition = mousePosition;
     mousePosition = event->globalPos();
@@ -118,8 +173,27 @@ void ImageWidget::mouseMoveEvent(QMouseEvent *event) {
 void ImageWidget::initializeGL() {
     initializeOpenGLFunctions();
 
+    // Uploads go through pixel unpack buffers when buffer mapping is available.
+    // That includes Mesa's software rasterizers; anything else uploads directly.
+    QOpenGLContext *ctx = context();
+    usePixelBuffers = ctx->isOpenGLES()
+        ? ctx->format().majorVersion() >= 3
+        : ctx->format().majorVersion() >= 3
+            || (ctx->hasExtension("GL_ARB_pixel_buffer_object") && ctx->hasExtension("GL_ARB_map_buffer_range"));
+    for (int i = 0; i < UPLOAD_BUFFER_COUNT && usePixelBuffers; i++) {
+        uploadBuffers[i] = QOpenGLBuffer(QOpenGLBuffer::PixelUnpackBuffer);
+        uploadBuffers[i].setUsagePattern(QOpenGLBuffer::StreamDraw);
+        usePixelBuffers = uploadBuffers[i].create();
+    }
+
     glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    // Canvases larger than the driver's texture size limit are split into tiles anyway
+    GLint maxTextureSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    if (maxTextureSize > 0) {
+        textureTileSize = MIN(TEXTURE_TILE_SIZE, maxTextureSize);
+    }
 
     updateTextures();
 
@@ -158,60 +232,356 @@ void ImageWidget::initializeGL() {
     program->bind();
 
     program->setUniformValue("texture", 0);
+
+    // Quads are rewritten every frame, one per visible texture tile
+    vertexBuffer.setUsagePattern(QOpenGLBuffer::StreamDraw);
+    vertexBuffer.create();
 }
 
+// Recomposites everything, for changes outside the active layer
 void ImageWidget::updateTextures() {
+    takeDirtyRect();
+    compositor_invalidate(compositor);
+    for (int i = 0; i < arrlen(bitmapTextures); i++) {
+        markTextureGrid(&bitmapTextures[i].grid, Rect { 0, 0, bitmapTextures[i].grid.width, bitmapTextures[i].grid.height });
+    }
+    updateTextures(Rect { 0, 0, image.width, image.height });
+}
 
-    if (isValid()) {
-        bitmap_free(&bitmap);
-        bitmap = bitmap_create(image.width, image.height);
-        for (int i = 0; i < arrlen(image.layers); i++) {
+// Queues the part of the canvas inside `dirty` for compositing. With GPU
+// compositing, paintGL() uploads what changed on each layer and blends them;
+// otherwise the compositor's thread does the blending and frameTick()
+// uploads the result once it is done.
+void ImageWidget::updateTextures(Rect dirty) {
+    if (gpuCompositingEnabled) {
+        requestRepaint();
+        return;
+    }
+    compositeLayers(dirty);
+}
+
+void ImageWidget::compositeLayers(Rect dirty) {
+    if (compositor_resize(compositor, image.width, image.height, image.format)) {
+        dirty = Rect { 0, 0, image.width, image.height };
+        if (compositor_out_of_memory(compositor)) {
+            warnOutOfMemory(tr("There isn't enough memory to composite a %1 x %2 image. "
+                               "GPU compositing may still be able to show it.").arg(image.width).arg(image.height));
+        }
+    }
+
+    // The temporary layer previews what will be blended into the active
+    // layer, so it goes right above it, in the active group
+    Layer **layers = NULL;
+    int firstActive = -1;
+    int firstAbove = -1;
+    for (int i = 0; i < arrlen(image.layers); i++) {
+        if (i == activeLayerIndex) {
+            firstActive = arrlen(layers);
             if (layerVisibilityMask[i]) {
-                bitmap_blend(&bitmap, &image.layers[i].bitmap, image.layers[i].x, image.layers[i].y);
+                arrput(layers, &image.layers[i]);
             }
+            arrput(layers, &tempLayer);
+            firstAbove = arrlen(layers);
+        } else if (layerVisibilityMask[i]) {
+            arrput(layers, &image.layers[i]);
         }
-        bitmap_blend(&bitmap, &tempLayer.bitmap, tempLayer.x, tempLayer.y);
+    }
+    if (firstActive < 0) {
+        firstActive = arrlen(layers);
+        arrput(layers, &tempLayer);
+        firstAbove = arrlen(layers);
+    }
+    compositor_submit(compositor, layers, arrlen(layers), firstActive, firstAbove, dirty);
+    arrfree(layers);
+}
 
-        glEnable(GL_TEXTURE_2D);
+// Marks a region of the front composite buffer that has just changed. Only
+// the texture tiles of it that are on screen are uploaded, by paintGL().
+void ImageWidget::queueComposite(Rect r) {
+    if (rect_is_empty(r)) {
+        return;
+    }
+    markTextureGrid(&compositeTextures, rect_downscale(r, compositeLevel));
+    requestRepaint();
+}
 
-        glDeleteTextures(1, &textureId); // This is safe to do because glDeleteTextures ignores 0
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-        glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
-        QImage image(bitmap.data, bitmap.width, bitmap.height, bitmap.width * 4, QImage::Format_RGBA8888, nullptr, nullptr);
+// Waits for queued compositing and returns the up to date composite, off
+// screen parts included
+Bitmap *ImageWidget::finishCompositing() {
+    compositor_set_viewport(compositor, Rect { 0, 0, image.width, image.height });
+    if (gpuCompositingEnabled) {
+        // The compositor isn't fed while the GPU blends the layers
+        compositor_invalidate(compositor);
+        compositeLayers(Rect { 0, 0, image.width, image.height });
+    } else {
+        compositeLayers(Rect { 0, 0, 0, 0 });
+    }
+    queueComposite(compositor_finish(compositor));
+    compositor_set_viewport(compositor, compositeViewport);
+    return compositor_front(compositor);
+}
 
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width(), image.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, image.bits());
+// Switches between blending layers on the compositor's thread and on the GPU
+void ImageWidget::setGpuCompositing(bool enabled) {
+    if (enabled == gpuCompositingEnabled) {
+        return;
+    }
+    gpuCompositingEnabled = enabled;
+    if (!enabled) {
+        freeLayerTextures();
+    }
+    updateTextures();
+}
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+// Gives `texture` new, uninitialized storage, creating it if needed
+void ImageWidget::allocateTexture(GLuint *texture, int width, int height) {
+    if (*texture == 0) {
+        glGenTextures(1, texture);
+    }
+    glBindTexture(GL_TEXTURE_2D, *texture);
+    glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+}
+
+// Copies part of a bitmap into a texture whose origin is the bitmap's pixel
+// (x, y). Tiled bitmaps are gathered into contiguous rows on the way, and
+// false is returned if there isn't memory for them.
+bool ImageWidget::uploadTexture(GLuint texture, Bitmap *bitmap, Rect r, int x, int y) {
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (usePixelBuffers) {
+        // Stage the rectangle in a pixel unpack buffer so glTexSubImage2D can
+        // return before the transfer is done. Cycling through several buffers
+        // keeps the next upload from waiting on one that's still in flight.
+        QOpenGLBuffer *buffer = &uploadBuffers[uploadBufferIndex];
+        uploadBufferIndex = (uploadBufferIndex + 1) % UPLOAD_BUFFER_COUNT;
+        // At most one texture tile, so the size fits the int Qt takes
+        size_t size = (size_t)r.width * r.height * 4;
+        buffer->bind();
+        buffer->allocate((int)size);
+        unsigned char *dst = (unsigned char*)buffer->mapRange(0, (int)size, QOpenGLBuffer::RangeWrite | QOpenGLBuffer::RangeInvalidateBuffer);
+        if (dst != nullptr) {
+            bitmap_read_pixels(bitmap, r.x, r.y, r.width, r.height, dst, r.width * 4);
+            buffer->unmap();
+            glTexSubImage2D(GL_TEXTURE_2D, 0, r.x - x, r.y - y, r.width, r.height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            buffer->release();
+            return true;
+        }
+        buffer->release();
+    }
 
-        glDisable(GL_TEXTURE_2D);
+    if (bitmap->storage == STORAGE_FLAT) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->width);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, r.x - x, r.y - y, r.width, r.height, GL_RGBA, GL_UNSIGNED_BYTE, bitmap->data + ((long long)r.y * bitmap->width + r.x) * 4);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        return true;
     }
+    unsigned char *pixels = (unsigned char*)malloc((size_t)r.width * r.height * 4);
+    if (pixels == NULL) {
+        return false;
+    }
+    bitmap_read_pixels(bitmap, r.x, r.y, r.width, r.height, pixels, r.width * 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, r.x - x, r.y - y, r.width, r.height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    free(pixels);
+    return true;
 }
 
-void ImageWidget::paintGL() {
-    if (backgroundTexture == 0) {
-        Bitmap background = bitmap_create(image.width, image.height);
-        for (int x = 0; x < image.width; x++) {
-            for (int y = 0; y < image.height; y++) {
-                bitmap_draw_pixel(&bitmap, x, y, (Color){255, 255, 255, 255});
+// Splits a grid into tiles covering a bitmap of the given size, dropping its
+// old textures
+void ImageWidget::resizeTextureGrid(TextureGrid *grid, int width, int height) {
+    freeTextureGrid(grid);
+    grid->width = width;
+    grid->height = height;
+    for (int y = 0; y < height; y += textureTileSize) {
+        for (int x = 0; x < width; x += textureTileSize) {
+            Rect rect = { x, y, MIN(textureTileSize, width - x), MIN(textureTileSize, height - y) };
+            arrput(grid->tiles, (TextureTile { 0, rect, Rect { 0, 0, 0, 0 } }));
+        }
+    }
+}
+
+void ImageWidget::markTextureGrid(TextureGrid *grid, Rect dirty) {
+    for (int i = 0; i < arrlen(grid->tiles); i++) {
+        TextureTile *tile = &grid->tiles[i];
+        Rect r = rect_intersect(tile->rect, dirty);
+        if (!rect_is_empty(r)) {
+            tile->dirty = rect_union(tile->dirty, r);
+        }
+    }
+}
+
+void ImageWidget::freeTextureGrid(TextureGrid *grid) {
+    for (int i = 0; i < arrlen(grid->tiles); i++) {
+        if (grid->tiles[i].texture != 0) {
+            glDeleteTextures(1, &grid->tiles[i].texture);
+        }
+    }
+    arrfree(grid->tiles);
+    grid->width = 0;
+    grid->height = 0;
+}
+
+// Queues a quad for every tile of a bitmap that is inside `visible`, a
+// rectangle of the bitmap, after bringing those tiles up to date. The bitmap
+// sits at (x, y) on the canvas, scaled up by 2^level. Tiles off screen keep
+// their dirty region until they are drawn, as do tiles that couldn't be
+// uploaded, which are left out of the frame.
+void ImageWidget::queueTextureGrid(TextureGrid *grid, Bitmap *bitmap, int x, int y, Rect visible, int level) {
+    Rect canvas = { 0, 0, image.width, image.height };
+    for (int i = 0; i < arrlen(grid->tiles); i++) {
+        TextureTile *tile = &grid->tiles[i];
+        Rect r = rect_intersect(tile->rect, visible);
+        if (rect_is_empty(r)) {
+            continue;
+        }
+        if (tile->texture == 0) {
+            allocateTexture(&tile->texture, tile->rect.width, tile->rect.height);
+            tile->dirty = tile->rect;
+        }
+        if (!rect_is_empty(tile->dirty)) {
+            if (!uploadTexture(tile->texture, bitmap, tile->dirty, tile->rect.x, tile->rect.y)) {
+                uploadFailed = true;
+                continue;
+            }
+            tile->dirty = Rect { 0, 0, 0, 0 };
+        }
+        // The last pixels of a scaled down level can overhang the canvas by a bit
+        Rect c = rect_intersect(Rect { x + (r.x << level), y + (r.y << level), r.width << level, r.height << level }, canvas);
+        GLfloat scale = 1.0f / (1 << level);
+        queueQuad(c,
+                ((c.x - x) * scale - tile->rect.x) / tile->rect.width,
+                ((c.y - y) * scale - tile->rect.y) / tile->rect.height,
+                ((c.x + c.width - x) * scale - tile->rect.x) / tile->rect.width,
+                ((c.y + c.height - y) * scale - tile->rect.y) / tile->rect.height,
+                tile->texture);
+    }
+}
+
+// Queues two triangles covering `r` on the canvas, textured with the part of
+// `texture` between (u1, v1) and (u2, v2)
+void ImageWidget::queueQuad(Rect r, GLfloat u1, GLfloat v1, GLfloat u2, GLfloat v2, GLuint texture) {
+    GLfloat x1 = viewLeft + r.x * viewPixelWidth;
+    GLfloat x2 = viewLeft + (r.x + r.width) * viewPixelWidth;
+    GLfloat y1 = viewTop - r.y * viewPixelHeight;
+    GLfloat y2 = viewTop - (r.y + r.height) * viewPixelHeight;
+    GLfloat quad[24] = {
+        x1, y2, u1, v2,
+        x2, y2, u2, v2,
+        x2, y1, u2, v1,
+        x1, y2, u1, v2,
+        x2, y1, u2, v1,
+        x1, y1, u1, v1,
+    };
+    for (int i = 0; i < 24; i++) {
+        arrput(quads, quad[i]);
+    }
+    arrput(quadTextures, texture);
+}
+
+// Brings the per-layer textures in line with the layers and queues the
+// visible layers, bottom to top. Textures of layers that are gone are
+// deleted. Parts of layers outside the canvas are cut off, like the
+// compositor does.
+void ImageWidget::queueLayerTextures(Rect visible) {
+    int count = arrlen(image.layers);
+    for (int i = arrlen(bitmapTextures) - 1; i >= 0; i--) {
+        bool used = bitmapTextures[i].id == tempLayer.id;
+        for (int j = 0; j < count && !used; j++) {
+            used = bitmapTextures[i].id == image.layers[j].id;
+        }
+        if (!used) {
+            freeTextureGrid(&bitmapTextures[i].grid);
+            arrdel(bitmapTextures, i);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        // The temporary layer goes right above the active one, as in compositeLayers()
+        for (int j = 0; j < (i == activeLayerIndex ? 2 : 1); j++) {
+            Layer *layer = j == 0 ? &image.layers[i] : &tempLayer;
+            LayerTexture *t = NULL;
+            for (int k = 0; k < arrlen(bitmapTextures) && t == NULL; k++) {
+                if (bitmapTextures[k].id == layer->id) {
+                    t = &bitmapTextures[k];
+                }
+            }
+            if (t == NULL) {
+                arrput(bitmapTextures, (LayerTexture { layer->id, TextureGrid {} }));
+                t = &arrlast(bitmapTextures);
+            }
+            if (t->grid.width != layer->bitmap.width || t->grid.height != layer->bitmap.height) {
+                resizeTextureGrid(&t->grid, layer->bitmap.width, layer->bitmap.height);
+            }
+            if (j == 0 && !layerVisibilityMask[i]) {
+                continue;
+            }
+            // Nothing outside the content needs a texture, let alone a quad
+            Rect r = rect_intersect(rect_offset(visible, -layer->x, -layer->y), layer->bitmap.content);
+            queueTextureGrid(&t->grid, &layer->bitmap, layer->x, layer->y, r, 0);
+        }
+    }
+}
+
+void ImageWidget::freeLayerTextures() {
+    if (isValid()) {
+        makeCurrent();
+    }
+    for (int i = 0; i < arrlen(bitmapTextures); i++) {
+        freeTextureGrid(&bitmapTextures[i].grid);
+    }
+    arrfree(bitmapTextures);
+}
+
+// Part of the canvas inside the widget, found the same way as globalToCanvas()
+Rect ImageWidget::visibleCanvasRect() {
+    QPoint topLeft = globalToCanvas(mapToGlobal(QPoint(0, 0)));
+    QPoint bottomRight = globalToCanvas(mapToGlobal(QPoint(width(), height())));
+    // One pixel of margin on each side makes up for the rounding towards zero
+    Rect r = { topLeft.x() - 1, topLeft.y() - 1, bottomRight.x() - topLeft.x() + 3, bottomRight.y() - topLeft.y() + 3 };
+    return rect_intersect(r, Rect { 0, 0, image.width, image.height });
+}
+
+// Collects everything drawn on the layers since the last call, in canvas coordinates
+Rect ImageWidget::takeDirtyRect() {
+    Rect dirty = {0, 0, 0, 0};
+    int count = arrlen(image.layers);
+    for (int i = 0; i <= count; i++) {
+        Layer *layer = i < count ? &image.layers[i] : &tempLayer;
+        Rect r = bitmap_take_dirty(&layer->bitmap);
+        dirty = rect_union(dirty, rect_offset(r, layer->x, layer->y));
+
+        // Layer textures keep their own dirty regions until they are drawn
+        for (int j = 0; j < arrlen(bitmapTextures); j++) {
+            if (bitmapTextures[j].id == layer->id) {
+                markTextureGrid(&bitmapTextures[j].grid, r);
             }
         }
-        glEnable(GL_TEXTURE_2D);
+    }
+    return dirty;
+}
+
+// Clears whatever was drawn on the temporary layer, which is left marked dirty
+void ImageWidget::clearTempLayer() {
+    bitmap_clear_rect(&tempLayer.bitmap, tempLayerUsed);
+    tempLayerUsed = Rect {0, 0, 0, 0};
+}
+
+void ImageWidget::paintGL() {
+    if (backgroundTexture == 0) {
+        // The background is a single white pixel stretched over the canvas
+        const unsigned char white[4] = { 255, 255, 255, 255 };
         glGenTextures(1, &backgroundTexture);
         glBindTexture(GL_TEXTURE_2D, backgroundTexture);
         glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
         glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
-        QImage image(bitmap.data, bitmap.width, bitmap.height, bitmap.width * 4, QImage::Format_RGBA8888, nullptr, nullptr);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width(), image.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, image.bits());
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
         glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glDisable(GL_TEXTURE_2D);
     }
 
-    QOpenGLBuffer vbo;
-
     glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
 
@@ -219,18 +589,38 @@ void ImageWidget::paintGL() {
     GLfloat yRatio = (GLfloat)scaleFactor * (GLfloat)image.height / (GLfloat)height();
     GLfloat scaledOffsetX = (GLfloat)offsetX * 2 / (GLfloat)width();
     GLfloat scaledOffsetY = (GLfloat)offsetY * 2 / (GLfloat)height();
-    GLfloat vertData[24] = {
-        -xRatio + scaledOffsetX, -yRatio - scaledOffsetY, 0, 1,
-        +xRatio + scaledOffsetX, -yRatio - scaledOffsetY, 1, 1,
-        +xRatio + scaledOffsetX, +yRatio - scaledOffsetY, 1, 0,
-        -xRatio + scaledOffsetX, -yRatio - scaledOffsetY, 0, 1,
-        +xRatio + scaledOffsetX, +yRatio - scaledOffsetY, 1, 0,
-        -xRatio + scaledOffsetX, +yRatio - scaledOffsetY, 0, 0,
-    };
-    vbo.create();
-    vbo.bind();
-    vbo.allocate(vertData, 24 * sizeof(GLfloat));
+    viewLeft = -xRatio + scaledOffsetX;
+    viewTop = yRatio - scaledOffsetY;
+    viewPixelWidth = 2 * xRatio / image.width;
+    viewPixelHeight = 2 * yRatio / image.height;
+
+    // Only texture tiles that intersect the viewport are uploaded and drawn
+    Rect canvas = { 0, 0, image.width, image.height };
+    Rect visible = visibleCanvasRect();
+    arrsetlen(quads, 0);
+    arrsetlen(quadTextures, 0);
+    bool failedBefore = uploadFailed;
+    uploadFailed = false;
+    queueQuad(canvas, 0, 0, 1, 1, backgroundTexture);
+    if (gpuCompositingEnabled) {
+        queueLayerTextures(visible);
+    } else {
+        // Zoomed out, the composite is drawn from the smallest level of the
+        // compositor's pyramid that still has a pixel for every screen pixel
+        int level = 0;
+        while (level + 1 < compositor_level_count(compositor) && scaleFactor * (2 << level) <= 1) {
+            level++;
+        }
+        Bitmap *composite = compositor_front_level(compositor, level);
+        if (level != compositeLevel || compositeTextures.width != composite->width || compositeTextures.height != composite->height) {
+            resizeTextureGrid(&compositeTextures, composite->width, composite->height);
+            compositeLevel = level;
+        }
+        queueTextureGrid(&compositeTextures, composite, 0, 0, rect_downscale(visible, level), level);
+    }
 
+    vertexBuffer.bind();
+    vertexBuffer.allocate(quads, arrlen(quads) * sizeof(GLfloat));
     program->enableAttributeArray(0);
     program->setAttributeBuffer(
             0,
@@ -246,14 +636,28 @@ void ImageWidget::paintGL() {
             2,
             4 * sizeof(GLfloat));
 
-    glBindTexture(GL_TEXTURE_2D, backgroundTexture);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
-
-    glBindTexture(GL_TEXTURE_2D, textureId);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+    // Premultiplied layers already have their colour scaled by alpha. The
+    // background is opaque, so blending layers one by one onto it gives the
+    // same result as blending them together first.
+    if (image.format == PIXEL_PREMULTIPLIED) {
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    } else {
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+    for (int i = 0; i < arrlen(quadTextures); i++) {
+        glBindTexture(GL_TEXTURE_2D, quadTextures[i]);
+        glDrawArrays(GL_TRIANGLES, i * 6, 6);
+    }
 
+    // The warning is shown once, after painting, while uploads keep failing
+    if (uploadFailed && !failedBefore) {
+        QTimer::singleShot(0, this, [this]() {
+            warnOutOfMemory(tr("There isn't enough memory to show the whole image, so parts of it are left out."));
+        });
+    }
 
-    update();
+    framesRendered++;
+    recordInputLatency();
 }
 
 void ImageWidget::resizeGL(int width, int height) {
@@ -261,47 +665,113 @@ void ImageWidget::resizeGL(int width, int height) {
 }
 
 ImageWidget::~ImageWidget() {
+    if (isValid()) {
+        makeCurrent();
+        freeTextureGrid(&compositeTextures);
+        glDeleteTextures(1, &backgroundTexture);
+        for (int i = 0; i < arrlen(bitmapTextures); i++) {
+            freeTextureGrid(&bitmapTextures[i].grid);
+        }
+        for (int i = 0; i < UPLOAD_BUFFER_COUNT; i++) {
+            uploadBuffers[i].destroy();
+        }
+        vertexBuffer.destroy();
+        doneCurrent();
+    }
+    compositor_free(compositor);
+    arrfree(bitmapTextures);
+    arrfree(quads);
+    arrfree(quadTextures);
+    arrfree(strokeQueue);
+    arrfree(pendingInput);
+    image_history_free(&hist);
+    brush_cache_free(&brushCache);
+}
+
+// Draws every queued stroke point in order, then queues a single composite
+// covering all of them
+void ImageWidget::drainStrokeQueue() {
+    int count = arrlen(strokeQueue);
+    if (count == 0) {
+        return;
+    }
+    // Shapes on the temporary layer are redrawn from scratch, so only the latest point matters
+    int first = activeTool == TOOL_LINE || activeTool == TOOL_RECTANGLE ? count - 1 : 0;
+    Rect dirty = { 0, 0, 0, 0 };
+    for (int i = first; i < count; i++) {
+        dirty = rect_union(dirty, applyTools(strokePosition, strokeQueue[i].position));
+        strokePosition = strokeQueue[i].position;
+    }
+    if (!rect_is_empty(dirty)) {
+        updateTextures(dirty);
+        arrput(pendingInput, (PendingInput { compositor_submitted(compositor), strokeQueue[0].time }));
+    }
+    arrsetlen(strokeQueue, 0);
 }
 
-void ImageWidget::applyTools(QMouseEvent *event) {
+// Called once a frame is drawn, for the input it now shows
+void ImageWidget::recordInputLatency() {
+    unsigned long long shown = compositor_front_sequence(compositor);
+    qint64 now = eTimer->nsecsElapsed();
+    int done = 0;
+    while (done < arrlen(pendingInput) && pendingInput[done].sequence <= shown) {
+        lastInputLatency = (now - pendingInput[done].time) / 1e6;
+        maxInputLatency = MAX(maxInputLatency, lastInputLatency);
+        totalInputLatency += lastInputLatency;
+        inputLatencySamples++;
+        done++;
+    }
+    arrdeln(pendingInput, 0, done);
+}
+
+// Applies the active tool for the pointer moving between two global positions
+// and returns the canvas area that needs compositing
+Rect ImageWidget::applyTools(QPoint from, QPoint to) {
     if (isLeftButtonDown) {
         // Translate mouse position to pixel position on the canvas
-        QPoint lastPixelPosition = globalToCanvas(lastMousePosition) - QPoint(image.layers[activeLayerIndex].x, image.layers[activeLayerIndex].y);
+        QPoint lastPixelPosition = globalToCanvas(from) - QPoint(image.layers[activeLayerIndex].x, image.layers[activeLayerIndex].y);
         QPoint lastMouseDownPixelPosition = globalToCanvas(lastMouseDownPosition) - QPoint(image.layers[activeLayerIndex].x, image.layers[activeLayerIndex].y);
-        QPoint pixelPosition = globalToCanvas(mousePosition) - QPoint(image.layers[activeLayerIndex].x, image.layers[activeLayerIndex].y);
+        QPoint pixelPosition = globalToCanvas(to) - QPoint(image.layers[activeLayerIndex].x, image.layers[activeLayerIndex].y);
 
         // Clear the temporary layer
-        for (int y = 0; y < tempLayer.bitmap.height; y++) {
-            for (int x = 0; x < tempLayer.bitmap.width; x++) {
-                Color c = {0, 0, 0, 0};
-                bitmap_draw_pixel(&tempLayer.bitmap, x, y, c);
-            }
-        }
+        clearTempLayer();
+        Rect dirty = rect_offset(bitmap_take_dirty(&tempLayer.bitmap), tempLayer.x, tempLayer.y);
 
         switch (activeTool) {
             case TOOL_PENCIL:
-                bitmap_draw_line(
+                if (antialiasEnabled) {
+                    // Each segment starts on the pixel the last one ended on,
+                    // which blending again would leave darker at every joint
+                    bitmap_draw_line_aa(
+                            &image.layers[activeLayerIndex].bitmap,
+                            lastPixelPosition.x(),
+                            lastPixelPosition.y(),
+                            pixelPosition.x(),
+                            pixelPosition.y(),
+                            activeColor,
+                            pencilStarted);
+                } else {
+                    bitmap_draw_line(
+                            &image.layers[activeLayerIndex].bitmap,
+                            lastPixelPosition.x(),
+                            lastPixelPosition.y(),
+                            pixelPosition.x(),
+                            pixelPosition.y(),
+                            activeColor);
+                }
+                pencilStarted = true;
+                break;
+            case TOOL_PAINTBRUSH:
+                brush_stroke_to(
+                        &stroke,
                         &image.layers[activeLayerIndex].bitmap,
-                        lastPixelPosition.x(),
-                        lastPixelPosition.y(),
+                        &brushCache,
+                        BrushTip { brushSize, brushHardness, brushAngle, brushRoundness, brushOpacity },
                         pixelPosition.x(),
                         pixelPosition.y(),
-                        activeColor);
-                break;
-            case TOOL_PAINTBRUSH:
-                for (int y = -brushSize/2; y < -brushSize/2 + brushSize; y++) {
-                    for (int x = -brushSize/2; x < -brushSize/2 + brushSize; x++) {
-                        if (sqrt((double)(x * x) + (double)(y * y)) < (double)brushSize/2.0f) {
-                            bitmap_draw_line(
-                                    &image.layers[activeLayerIndex].bitmap,
-                                    lastPixelPosition.x() + x,
-                                    lastPixelPosition.y() + y,
-                                    pixelPosition.x() + x,
-                                    pixelPosition.y() + y,
-                                    activeColor);
-                        }
-                    }
-                }
+                        brushSpacing,
+                        activeColor,
+                        BRUSH_PAINT);
                 break;
             case TOOL_COLOR_PICKER:
                 Color color;
@@ -315,7 +785,8 @@ void ImageWidget::applyTools(QMouseEvent *event) {
                                 &image.layers[activeLayerIndex].bitmap,
                                 pixelPosition.x(),
                                 pixelPosition.y(),
-                                activeColor);
+                                activeColor,
+                                fillTolerance);
                 break;
             case TOOL_SPRAY_CAN:
                 if (!timer->isActive()) {
@@ -323,40 +794,51 @@ void ImageWidget::applyTools(QMouseEvent *event) {
                 }
                 break;
             case TOOL_ERASER:
-                for (int y = -5; y < 5; y++) {
-                    for (int x = -5; x < 5; x++) {
-                        if (sqrt((double)(x * x) + (double)(y * y)) < 5.0f) {
-                            bitmap_draw_line(
-                                    &image.layers[activeLayerIndex].bitmap,
-                                    lastPixelPosition.x() + x,
-                                    lastPixelPosition.y() + y,
-                                    pixelPosition.x() + x,
-                                    pixelPosition.y() + y,
-                                    Color { 0, 0, 0, 0 });
-                        }
-                    }
-                }
+                brush_stroke_to(
+                        &stroke,
+                        &image.layers[activeLayerIndex].bitmap,
+                        &brushCache,
+                        BrushTip { eraserSize, 1.0f, 0.0f, 1.0f, 255 },
+                        pixelPosition.x(),
+                        pixelPosition.y(),
+                        brushSpacing,
+                        activeColor,
+                        BRUSH_ERASE);
                 break;
             case TOOL_MOVE:
                 {
+                    Layer *layer = &image.layers[activeLayerIndex];
                     QPoint diff = pixelPosition - lastPixelPosition;
-                    image.layers[activeLayerIndex].x += diff.x();
-                    image.layers[activeLayerIndex].y += diff.y();
+                    dirty = rect_union(dirty, Rect { layer->x, layer->y, layer->bitmap.width, layer->bitmap.height });
+                    layer->x += diff.x();
+                    layer->y += diff.y();
                     tempLayer.x += diff.x();
                     tempLayer.y += diff.y();
+                    dirty = rect_union(dirty, Rect { layer->x, layer->y, layer->bitmap.width, layer->bitmap.height });
                 }
                 break;
             case TOOL_RECTANGLE_SELECT:
                 break;
             case TOOL_LINE:
                 {
-                    bitmap_draw_line(
-                            &tempLayer.bitmap, 
-                            lastMouseDownPixelPosition.x(),
-                            lastMouseDownPixelPosition.y(),
-                            pixelPosition.x(),
-                            pixelPosition.y(),
-                            activeColor);
+                    if (antialiasEnabled) {
+                        bitmap_draw_line_aa(
+                                &tempLayer.bitmap,
+                                lastMouseDownPixelPosition.x(),
+                                lastMouseDownPixelPosition.y(),
+                                pixelPosition.x(),
+                                pixelPosition.y(),
+                                activeColor,
+                                false);
+                    } else {
+                        bitmap_draw_line(
+                                &tempLayer.bitmap,
+                                lastMouseDownPixelPosition.x(),
+                                lastMouseDownPixelPosition.y(),
+                                pixelPosition.x(),
+                                pixelPosition.y(),
+                                activeColor);
+                    }
                 }
                 break;
             case TOOL_RECTANGLE:
@@ -367,11 +849,7 @@ void ImageWidget::applyTools(QMouseEvent *event) {
                     int y2 = MAX(lastMouseDownPixelPosition.y(), pixelPosition.y());
                     switch (fillMode) {
                         case FILL_FILL:
-                            {
-                                for (int y = y1; y < y2; y++) {
-                                    bitmap_draw_line(&tempLayer.bitmap, x1, y, x2, y, activeColor);
-                                }
-                            }
+                            bitmap_fill_rect(&tempLayer.bitmap, Rect { x1, y1, x2 - x1 + 1, y2 - y1 }, activeColor);
                             break;
                         case FILL_OUTLINE:
                             {
@@ -396,71 +874,153 @@ void ImageWidget::applyTools(QMouseEvent *event) {
             default:
                 break;
         }
-        updateTextures();
-        update();
+        tempLayerUsed = tempLayer.bitmap.dirty;
+        return rect_union(dirty, takeDirtyRect());
     }
+    return Rect { 0, 0, 0, 0 };
 }
 
 void ImageWidget::useSprayCan() {
     QPoint pixelPosition = globalToCanvas(mousePosition);
     int x = pixelPosition.x();
     int y = pixelPosition.y();
+    // The spray area is a hard 40 px tip, centred on the cursor pixel
+    BrushMask *mask = brush_cache_get(&brushCache, BrushTip { 40, 1.0f, 0.0f, 1.0f, 255 }, BRUSH_SUBPIXEL_STEPS / 2, BRUSH_SUBPIXEL_STEPS / 2);
+    if (mask == NULL) {
+        return;
+    }
     for (int i = 0; i < 20; i++) {
         int dx = QRandomGenerator::global()->bounded(-20, 20);
         int dy = QRandomGenerator::global()->bounded(-20, 20);
-        if (sqrt((double)(dx * dx) + (double)(dy * dy)) < 20.0f) {
+        if (mask->alpha[(dy + 20) * mask->width + dx + 20] >= 128) {
             bitmap_draw_pixel(&image.layers[activeLayerIndex].bitmap, x + dx, y + dy, activeColor);
         }
     }
-    updateTextures();
-    update();
+    updateTextures(takeDirtyRect());
 }
 
+// Rotates the image clockwise by a multiple of 90 degrees
 void ImageWidget::rotate(int degrees) {
-    switch (degrees) {
-        case 90:
-            {
-                int oldY = image.height;
-                int temp = image.width;
-                image.width = image.height;
-                image.height = temp;
-                for (int i = 0; i < arrlen(image.layers); i++) {
-
-                    Bitmap newBitmap = bitmap_create_rotated(&image.layers[i].bitmap);
-                    Layer layer = layer_create_from_bitmap(
-                            image.layers[i].name,
-                            oldY - image.layers[i].y - image.layers[i].bitmap.height,
-                            image.layers[i].x,
-                            newBitmap);
-                    layer_free(&image.layers[i]);
-                    image.layers[i] = layer;
-                }
-                updateTextures();
-            }
-            break;
-        default:
-            break;
+    degrees = ((degrees % 360) + 360) % 360;
+    if (degrees % 90 != 0 || degrees == 0) {
+        return;
+    }
+    // Every layer is rotated before any is replaced, so running out of memory
+    // leaves the image as it was
+    bitmap_take_allocation_failure();
+    Bitmap *rotated = NULL;
+    bool failed = false;
+    for (int i = 0; i < arrlen(image.layers) && !failed; i++) {
+        Bitmap *old = &image.layers[i].bitmap;
+        arrput(rotated, bitmap_create_rotated(old, degrees));
+        failed = arrlast(rotated).width != (degrees == 180 ? old->width : old->height);
+    }
+    if (bitmap_take_allocation_failure() || failed) {
+        for (int i = 0; i < arrlen(rotated); i++) {
+            bitmap_free(&rotated[i]);
+        }
+        arrfree(rotated);
+        warnOutOfMemory(tr("There isn't enough memory to rotate the image."));
+        return;
     }
-}
 
-void ImageWidget::flipHorizontal() {
+    int oldWidth = image.width;
+    int oldHeight = image.height;
+    if (degrees != 180) {
+        image.width = oldHeight;
+        image.height = oldWidth;
+    }
+    // Layers keep their ids, so history, the compositor and the GPU textures
+    // still recognise them
     for (int i = 0; i < arrlen(image.layers); i++) {
-        Bitmap newBitmap = bitmap_create_flipped_horizontal(&image.layers[i].bitmap);
-        bitmap_free(&image.layers[i].bitmap);
-        image.layers[i].bitmap = newBitmap;
+        Layer *layer = &image.layers[i];
+        int x = oldHeight - layer->y - layer->bitmap.height;
+        int y = layer->x;
+        if (degrees == 180) {
+            x = oldWidth - layer->x - layer->bitmap.width;
+            y = oldHeight - layer->y - layer->bitmap.height;
+        } else if (degrees == 270) {
+            x = layer->y;
+            y = oldWidth - layer->x - layer->bitmap.width;
+        }
+        bitmap_free(&layer->bitmap);
+        layer->bitmap = rotated[i];
+        layer->x = x;
+        layer->y = y;
     }
+    arrfree(rotated);
+    fitTempLayer();
     updateTextures();
 }
 
-void ImageWidget::flipVertical() {
+// Flips every layer in place. If one of them runs out of memory, the layers
+// already flipped are flipped back so the image stays consistent.
+void ImageWidget::flip(bool horizontal) {
+    int flipped = 0;
+    for (; flipped < arrlen(image.layers); flipped++) {
+        Bitmap *bitmap = &image.layers[flipped].bitmap;
+        if (!(horizontal ? bitmap_flip_horizontal(bitmap) : bitmap_flip_vertical(bitmap))) {
+            break;
+        }
+    }
+    if (flipped < arrlen(image.layers)) {
+        for (int i = 0; i < flipped; i++) {
+            if (horizontal) {
+                bitmap_flip_horizontal(&image.layers[i].bitmap);
+            } else {
+                bitmap_flip_vertical(&image.layers[i].bitmap);
+            }
+        }
+        bitmap_take_allocation_failure();
+        warnOutOfMemory(tr("There isn't enough memory to flip the image."));
+        updateTextures();
+        return;
+    }
     for (int i = 0; i < arrlen(image.layers); i++) {
-        Bitmap newBitmap = bitmap_create_flipped_vertical(&image.layers[i].bitmap);
-        bitmap_free(&image.layers[i].bitmap);
-        image.layers[i].bitmap = newBitmap;
+        Layer *layer = &image.layers[i];
+        if (horizontal) {
+            layer->x = image.width - layer->x - layer->bitmap.width;
+        } else {
+            layer->y = image.height - layer->y - layer->bitmap.height;
+        }
     }
+    setActiveLayer(activeLayerIndex);
     updateTextures();
 }
 
+void ImageWidget::flipHorizontal() {
+    flip(true);
+}
+
+void ImageWidget::flipVertical() {
+    flip(false);
+}
+
+void ImageWidget::warnOutOfMemory(QString message) {
+    QMessageBox::warning(this, tr("Out of Memory"), message);
+}
+
+// Drawing and undoing skip what they couldn't allocate memory for, so once
+// they are done the user is told part of the change is missing
+void ImageWidget::warnIfAllocationFailed() {
+    if (bitmap_take_allocation_failure()) {
+        warnOutOfMemory(tr("There wasn't enough memory for the last change, so part of it is missing."));
+    }
+}
+
+// The temporary layer has to match the canvas, which rotating it, or undoing
+// or redoing a rotation, resizes
+void ImageWidget::fitTempLayer() {
+    if (tempLayer.bitmap.width != image.width || tempLayer.bitmap.height != image.height || tempLayer.bitmap.format != image.format) {
+        layer_free(&tempLayer);
+        tempLayer = layer_create("temp", 0, 0, image.width, image.height, image.format);
+        tempLayerUsed = Rect { 0, 0, 0, 0 };
+    }
+    if (activeLayerIndex < arrlen(image.layers)) {
+        setActiveLayer(activeLayerIndex);
+    }
+}
+
 void ImageWidget::setActiveLayer(int index) {
     activeLayerIndex = index;
     tempLayer.x = image.layers[activeLayerIndex].x;
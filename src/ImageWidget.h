@@ -1,16 +1,20 @@
 #ifndef IMAGEWIDGET_H
 #define IMAGEWIDGET_H
 
+#include <climits>
+
 #include <QColor>
 #include <QDir>
 #include <QElapsedTimer>
 #include <QExposeEvent>
 #include <QGuiApplication>
+#include <QHideEvent>
 #include <QImageReader>
 #include <QList>
 #include <QMessageBox>
 #include <QMouseEvent>
 #include <QOpenGLBuffer>
+#include <QOpenGLContext>
 #include <QOpenGLFunctions>
 #include <QOpenGLShader>
 #include <QOpenGLTexture>
@@ -18,17 +22,64 @@
 #include <QResizeEvent>
 #include <QScrollArea>
 #include <QScrollBar>
+#include <QShowEvent>
 #include <QString>
 #include <QTimer>
 #include <QWheelEvent>
 
 #include "Bitmap.h"
+#include "Brush.h"
+#include "Compositor.h"
+#include "History.h"
 #include "Image.h"
 #include "common.h"
 
 QT_FORWARD_DECLARE_CLASS(QOpenGLShaderProgram);
 QT_FORWARD_DECLARE_CLASS(QOpenGLTexture);
 
+// Interval at which pending repaints are flushed
+#define FRAME_INTERVAL_MS 16
+
+// Number of pixel unpack buffers texture uploads cycle through
+#define UPLOAD_BUFFER_COUNT 3
+
+// Largest texture the canvas is split into, if the driver allows it
+#define TEXTURE_TILE_SIZE 2048
+
+// A pointer position waiting to be drawn, with when it arrived
+struct StrokePoint {
+    QPoint position;
+    qint64 time; // Nanoseconds on the widget's elapsed timer
+};
+
+// Input that has been drawn but is not on screen yet
+struct PendingInput {
+    unsigned long long sequence; // Compositor submit that includes it
+    qint64 time; // Arrival of its oldest stroke point
+};
+
+// One texture of a TextureGrid
+struct TextureTile {
+    GLuint texture; // 0 until the tile is first drawn
+    Rect rect; // Part of the bitmap it holds
+    Rect dirty; // Changed in the bitmap since the last upload
+};
+
+// A bitmap on the GPU, split into textures no larger than the driver allows.
+// Tiles are only created and uploaded once they are drawn, so the parts of a
+// large canvas that were never on screen cost nothing.
+struct TextureGrid {
+    TextureTile *tiles; // stb_ds array
+    int width;
+    int height;
+};
+
+// Textures of one layer when layers are composited on the GPU
+struct LayerTexture {
+    int id; // Layer the textures belong to
+    TextureGrid grid;
+};
+
 enum FillMode {
     FILL_FILL,
     FILL_OUTLINE,
@@ -52,22 +103,29 @@ public:
     void mousePressEvent(QMouseEvent *event) override;
     void mouseReleaseEvent(QMouseEvent *event) override;
     void mouseMoveEvent(QMouseEvent *event) override;
+    void showEvent(QShowEvent *event) override;
+    void hideEvent(QHideEvent *event) override;
     void initializeGL() override;
     void paintGL() override;
     void resizeGL(int width, int height) override;
     void updateTextures();
+    void updateTextures(Rect dirty);
     void rotate(int degrees);
     void flipHorizontal();
     void flipVertical();
+    void fitTempLayer();
+    void warnOutOfMemory(QString message);
+    void warnIfAllocationFailed();
     void setActiveLayer(int index);
-
-    Bitmap bitmap = bitmap_create(0, 0);
+    void setGpuCompositing(bool enabled);
+    void requestRepaint();
+    Bitmap *finishCompositing();
 
     int activeLayerIndex;
     bool isImageInitialized = false;
     Image image;
     Layer tempLayer;
-    ImageHistory hist = (ImageHistory){0, -1};
+    ImageHistory hist = image_history_create();
     bool *layerVisibilityMask = NULL;
     Tool activeTool = TOOL_PENCIL;
     Color activeColor = {0, 0, 0, 255};
@@ -77,13 +135,33 @@ public:
     // Tool settings
     FillMode fillMode = FILL_OUTLINE;
     int brushSize = 20;
+    float brushHardness = 1.0f;
+    float brushAngle = 0.0f;
+    float brushRoundness = 1.0f;
+    int brushOpacity = 255;
+    float brushSpacing = BRUSH_DEFAULT_SPACING;
+    int eraserSize = 10;
+    int fillTolerance = 0; // Per channel difference from the clicked colour the fill tool still covers
     bool snapEnabled = false;
+    bool antialiasEnabled = false; // Pencil and line tools draw antialiased lines
+    bool gpuCompositingEnabled = false; // Layers are uploaded separately and blended while drawing
+
+    // Render statistics
+    quint64 framesRendered = 0;
+    quint64 idleFramesSkipped = 0; // Frame ticks on which nothing had changed
+    double lastInputLatency = 0; // Milliseconds from a pointer event to the frame showing it
+    double maxInputLatency = 0;
+    double totalInputLatency = 0;
+    quint64 inputLatencySamples = 0;
+    BrushCache brushCache = brush_cache_create();
 
 signals:
     void sendColorChanged(Color color);
 
 private:
     QTimer *timer;
+    QTimer *frameTimer;
+    bool needsRepaint = true;
     QElapsedTimer *eTimer;
     QPoint mousePosition;
     QPoint lastMousePosition;
@@ -93,13 +171,57 @@ private:
     QOpenGLTexture *texture;
     bool isMiddleButtonDown = false;
     bool isLeftButtonDown = false;
+    Compositor *compositor = compositor_create();
     QOpenGLShaderProgram *program;
-    GLuint textureId = 0;
-    GLuint *bitmapTextures;
+    QOpenGLBuffer vertexBuffer;
+    TextureGrid compositeTextures = {};
+    int compositeLevel = 0; // Level of the compositor's pyramid compositeTextures holds
+    Rect compositeViewport = { 0, 0, INT_MAX, INT_MAX }; // Last passed to compositor_set_viewport()
+    int textureTileSize = TEXTURE_TILE_SIZE;
+    bool usePixelBuffers = false;
+    QOpenGLBuffer uploadBuffers[UPLOAD_BUFFER_COUNT];
+    int uploadBufferIndex = 0;
+    bool uploadFailed = false; // A texture tile couldn't be uploaded in the last frame
+    LayerTexture *bitmapTextures = NULL; // One per layer, the temporary one included
+    GLfloat *quads = NULL; // Vertex data of everything drawn this frame, 24 floats per quad
+    GLuint *quadTextures = NULL; // Texture of each quad
+    GLfloat viewLeft = 0; // Canvas origin and pixel size in clip space, for queueQuad()
+    GLfloat viewTop = 0;
+    GLfloat viewPixelWidth = 0;
+    GLfloat viewPixelHeight = 0;
     GLuint backgroundTexture = 0;
 
+    Rect tempLayerUsed = {0, 0, 0, 0}; // Area drawn on the temporary layer since it was last cleared
+
+    BrushStroke stroke = brush_stroke_begin();
+    bool pencilStarted = false; // The pencil has drawn the first point of the stroke
+
+    // Pointer motion is queued as it arrives and drawn once per frame tick
+    StrokePoint *strokeQueue = NULL;
+    QPoint strokePosition; // Last point drawn
+    PendingInput *pendingInput = NULL;
+
+    void frameTick();
+    void updateViewport();
     void useSprayCan();
-    void applyTools(QMouseEvent *event);
+    Rect applyTools(QPoint from, QPoint to);
+    void drainStrokeQueue();
+    void recordInputLatency();
+    void clearTempLayer();
+    void flip(bool horizontal);
+    void compositeLayers(Rect dirty);
+    void allocateTexture(GLuint *texture, int width, int height);
+    bool uploadTexture(GLuint texture, Bitmap *bitmap, Rect r, int x, int y);
+    void resizeTextureGrid(TextureGrid *grid, int width, int height);
+    void markTextureGrid(TextureGrid *grid, Rect dirty);
+    void freeTextureGrid(TextureGrid *grid);
+    void queueTextureGrid(TextureGrid *grid, Bitmap *bitmap, int x, int y, Rect visible, int level);
+    void queueQuad(Rect r, GLfloat u1, GLfloat v1, GLfloat u2, GLfloat v2, GLuint texture);
+    void queueComposite(Rect r);
+    void queueLayerTextures(Rect visible);
+    void freeLayerTextures();
+    Rect visibleCanvasRect();
+    Rect takeDirtyRect();
 };
 
 #endif
@@ -0,0 +1,180 @@
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "Parallel.h"
+#include "common.h"
+
+// The indices of a parallel_for are split into one contiguous range per
+// thread. Threads take indices from the front of their own range and, once it
+// runs dry, steal the back half of another thread's, so uneven work balances
+// out without every index going through one shared counter.
+struct WorkRange {
+    std::mutex lock;
+    int begin;
+    int end;
+};
+
+// Workers are started on first use and sleep between jobs. The thread that
+// calls parallel_for takes the last range.
+struct ThreadPool {
+    std::mutex lock; // Guards everything below except the ranges
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::thread workers[PARALLEL_MAX_THREADS];
+    int worker_count;
+    int thread_count; // 0 until first used
+    bool quit;
+    unsigned long long generation; // Bumped for every job
+    int active; // Workers still busy with the current job
+    ParallelFunc fn;
+    void *data;
+    WorkRange ranges[PARALLEL_MAX_THREADS];
+
+    std::mutex busy; // Held for the whole of a parallel_for
+
+    ~ThreadPool();
+};
+
+static ThreadPool pool;
+
+// Set on worker threads, and on the calling thread while it runs a job
+static thread_local bool in_parallel_for = false;
+
+static bool parallel_take(int self, int *index) {
+    WorkRange *own = &pool.ranges[self];
+    {
+        std::lock_guard<std::mutex> guard(own->lock);
+        if (own->begin < own->end) {
+            *index = own->begin++;
+            return true;
+        }
+    }
+    for (int i = 1; i < pool.thread_count; i++) {
+        WorkRange *victim = &pool.ranges[(self + i) % pool.thread_count];
+        int begin;
+        int end;
+        {
+            std::lock_guard<std::mutex> guard(victim->lock);
+            int remaining = victim->end - victim->begin;
+            if (remaining <= 0) {
+                continue;
+            }
+            end = victim->end;
+            begin = end - (remaining + 1) / 2;
+            victim->end = begin;
+        }
+        std::lock_guard<std::mutex> guard(own->lock);
+        own->begin = begin + 1;
+        own->end = end;
+        *index = begin;
+        return true;
+    }
+    return false;
+}
+
+static void parallel_run(int self) {
+    int index;
+    while (parallel_take(self, &index)) {
+        pool.fn(index, pool.data);
+    }
+}
+
+static void parallel_worker(int self) {
+    in_parallel_for = true;
+    unsigned long long seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(pool.lock);
+            pool.wake.wait(guard, [&] { return pool.quit || pool.generation != seen; });
+            if (pool.quit) {
+                return;
+            }
+            seen = pool.generation;
+        }
+        parallel_run(self);
+        std::lock_guard<std::mutex> guard(pool.lock);
+        if (--pool.active == 0) {
+            pool.done.notify_one();
+        }
+    }
+}
+
+// Both called with `busy` held
+static void parallel_stop_workers() {
+    {
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.quit = true;
+    }
+    pool.wake.notify_all();
+    for (int i = 0; i < pool.worker_count; i++) {
+        pool.workers[i].join();
+    }
+    pool.worker_count = 0;
+    pool.quit = false;
+}
+
+static void parallel_start_workers() {
+    if (pool.thread_count == 0) {
+        pool.thread_count = MAX(1, MIN(PARALLEL_MAX_THREADS, (int)std::thread::hardware_concurrency()));
+    }
+    pool.generation = 0;
+    for (int i = 0; i < pool.thread_count - 1; i++) {
+        pool.workers[i] = std::thread(parallel_worker, i);
+    }
+    pool.worker_count = pool.thread_count - 1;
+}
+
+ThreadPool::~ThreadPool() {
+    std::lock_guard<std::mutex> guard(busy);
+    parallel_stop_workers();
+}
+
+void parallel_for(int count, ParallelFunc fn, void *data) {
+    if (count <= 1 || in_parallel_for || !pool.busy.try_lock()) {
+        for (int i = 0; i < count; i++) {
+            fn(i, data);
+        }
+        return;
+    }
+    if (pool.worker_count == 0) {
+        parallel_start_workers();
+    }
+    int threads = pool.thread_count;
+    for (int i = 0; i < threads; i++) {
+        std::lock_guard<std::mutex> guard(pool.ranges[i].lock);
+        pool.ranges[i].begin = (int)((long long)count * i / threads);
+        pool.ranges[i].end = (int)((long long)count * (i + 1) / threads);
+    }
+    {
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.fn = fn;
+        pool.data = data;
+        pool.active = threads - 1;
+        pool.generation++;
+    }
+    pool.wake.notify_all();
+
+    in_parallel_for = true;
+    parallel_run(threads - 1);
+    in_parallel_for = false;
+    {
+        std::unique_lock<std::mutex> guard(pool.lock);
+        pool.done.wait(guard, [] { return pool.active == 0; });
+    }
+    pool.busy.unlock();
+}
+
+int parallel_thread_count() {
+    std::lock_guard<std::mutex> guard(pool.busy);
+    if (pool.thread_count == 0) {
+        return MAX(1, MIN(PARALLEL_MAX_THREADS, (int)std::thread::hardware_concurrency()));
+    }
+    return pool.thread_count;
+}
+
+void parallel_set_thread_count(int count) {
+    std::lock_guard<std::mutex> guard(pool.busy);
+    parallel_stop_workers();
+    pool.thread_count = MAX(0, MIN(PARALLEL_MAX_THREADS, count));
+}
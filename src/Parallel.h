@@ -0,0 +1,21 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// Upper bound for parallel_set_thread_count()
+#define PARALLEL_MAX_THREADS 64
+
+typedef void (*ParallelFunc)(int index, void *data);
+
+// Calls fn(i, data) for every i in [0, count) on the worker pool and returns
+// once all calls have finished. Each index is handed out once, so calls may
+// write to disjoint parts of shared data without locking. Calls made from
+// inside fn, or while another thread is running a parallel_for, run serially
+// on the calling thread.
+void parallel_for(int count, ParallelFunc fn, void *data);
+
+// Number of threads parallel_for spreads work over, the calling thread
+// included. Defaults to one per core; 0 restores the default.
+int parallel_thread_count();
+void parallel_set_thread_count(int count);
+
+#endif // PARALLEL_H
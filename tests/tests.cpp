@@ -0,0 +1,326 @@
+// Tests for the parts of the painter that don't depend on Qt. Exits with a
+// non-zero status when a check fails.
+
+#include <climits>
+#include <cstdio>
+
+#include "lib/stb_ds.h"
+
+#include "src/Bitmap.h"
+#include "src/Compositor.h"
+#include "src/History.h"
+#include "src/Image.h"
+
+// Large enough that the pixels take more than 2 GB, so byte offsets past the
+// first 2 GB don't fit in an int
+#define LARGE_SIZE 24000
+
+static int failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+static void check(bool ok, const char *condition, const char *file, int line) {
+    if (!ok) {
+        printf("%s:%d: check failed: %s\n", file, line, condition);
+        failures++;
+    }
+}
+
+static Color pixel(Bitmap *bitmap, int x, int y) {
+    Color color = { 0, 0, 0, 0 };
+    bitmap_get_pixel(bitmap, x, y, &color);
+    return color;
+}
+
+static const Color RED = { 255, 0, 0, 255 };
+static const Color GREEN = { 0, 255, 0, 255 };
+static const Color BLUE = { 0, 0, 255, 255 };
+static const Color GRAY = { 128, 128, 128, 255 };
+static const Color TRANSPARENT = { 0, 0, 0, 0 };
+
+// Sizes too big to allocate, or to even count in bytes on 32-bit builds,
+// give an empty bitmap instead
+static void test_create_too_large() {
+    Bitmap flat = bitmap_create(INT_MAX, INT_MAX);
+    CHECK(flat.width == 0 && flat.height == 0 && flat.data == NULL);
+    bitmap_free(&flat);
+
+    Bitmap tiled = bitmap_create_tiled(INT_MAX, INT_MAX);
+    CHECK(tiled.width == 0 && tiled.height == 0 && tiled.tiles == NULL);
+    bitmap_free(&tiled);
+}
+
+// Draws, fills, blends, flips and copies in the far corner of a bitmap of
+// more than 2 GB
+static void test_large(bool tiled) {
+    const char *name = tiled ? "tiled" : "flat";
+    Bitmap bitmap = tiled ? bitmap_create_tiled(LARGE_SIZE, LARGE_SIZE) : bitmap_create(LARGE_SIZE, LARGE_SIZE);
+    if (bitmap.width == 0) {
+        printf("Skipping the large %s bitmap test: not enough memory\n", name);
+        return;
+    }
+    CHECK(bitmap.size == (size_t)LARGE_SIZE * LARGE_SIZE * 4);
+    int last = LARGE_SIZE - 1;
+
+    CHECK(bitmap_draw_pixel(&bitmap, last, last, RED));
+    CHECK(color_eq(pixel(&bitmap, last, last), RED));
+
+    // The lines close off the bottom right corner, which is then flood filled
+    bitmap_draw_line(&bitmap, last - 100, last - 100, last, last - 100, BLUE);
+    bitmap_draw_line(&bitmap, last - 100, last - 100, last - 100, last, BLUE);
+    bitmap_fill(&bitmap, last - 50, last - 50, GREEN, 0);
+    CHECK(color_eq(pixel(&bitmap, last - 50, last - 50), GREEN));
+    CHECK(color_eq(pixel(&bitmap, last - 100, last - 50), BLUE));
+    CHECK(color_eq(pixel(&bitmap, last - 101, last - 50), TRANSPARENT));
+    CHECK(color_eq(pixel(&bitmap, last, last), RED));
+
+    // The rows around the first pixel 2 GB in
+    int row = (int)(((size_t)1 << 31) / ((size_t)LARGE_SIZE * 4));
+    bitmap_fill_rect(&bitmap, Rect { 0, row - 10, LARGE_SIZE, 20 }, GRAY);
+    CHECK(color_eq(pixel(&bitmap, LARGE_SIZE / 2, row), GRAY));
+    CHECK(color_eq(pixel(&bitmap, last, row + 9), GRAY));
+    CHECK(color_eq(pixel(&bitmap, 0, row - 11), TRANSPARENT));
+
+    Bitmap source = bitmap_create(64, 64);
+    bitmap_fill_rect(&source, Rect { 0, 0, 64, 64 }, BLUE);
+    CHECK(bitmap_blend(&bitmap, &source, LARGE_SIZE - 300, LARGE_SIZE - 300));
+    CHECK(color_eq(pixel(&bitmap, LARGE_SIZE - 270, LARGE_SIZE - 270), BLUE));
+    CHECK(color_eq(pixel(&bitmap, LARGE_SIZE - 236, LARGE_SIZE - 270), TRANSPARENT));
+    bitmap_free(&source);
+
+    CHECK(bitmap_flip_horizontal(&bitmap));
+    CHECK(color_eq(pixel(&bitmap, 0, last), RED));
+    CHECK(color_eq(pixel(&bitmap, 50, last - 50), GREEN));
+    CHECK(bitmap_flip_horizontal(&bitmap));
+    CHECK(color_eq(pixel(&bitmap, last, last), RED));
+
+    // Tiled copies of a region only share the tiles it touches
+    Bitmap region = bitmap_copy_region(&bitmap, Rect { last - 100, last - 100, 101, 101 });
+    if (region.width == 0) {
+        printf("Skipping the region copy of the large %s bitmap: not enough memory\n", name);
+    } else {
+        CHECK(color_eq(pixel(&region, last, last), RED));
+        CHECK(color_eq(pixel(&region, last - 50, last - 50), GREEN));
+        CHECK(color_eq(pixel(&region, LARGE_SIZE / 2, row), tiled ? TRANSPARENT : GRAY));
+    }
+    bitmap_free(&region);
+
+    Bitmap copy = bitmap_copy(&bitmap);
+    if (copy.width == 0) {
+        printf("Skipping the copy of the large %s bitmap: not enough memory\n", name);
+    } else {
+        CHECK(copy.size == bitmap.size);
+        CHECK(color_eq(pixel(&copy, last, last), RED));
+        CHECK(color_eq(pixel(&copy, LARGE_SIZE / 2, row), GRAY));
+    }
+    bitmap_free(&copy);
+    bitmap_free(&bitmap);
+}
+
+// Blending transparent pixels leaves the tiles a layer shares with its
+// snapshot alone, so the history doesn't see them as changed
+static void test_blend_keeps_shared_tiles() {
+    Bitmap layer = bitmap_create_tiled(256, 256);
+    bitmap_fill_rect(&layer, Rect { 0, 0, 256, 256 }, GRAY);
+    bitmap_draw_pixel(&layer, 10, 10, RED);
+    Bitmap snapshot = bitmap_copy(&layer);
+
+    Bitmap temp = bitmap_create_tiled(256, 256);
+    bitmap_draw_line(&temp, 0, 0, 255, 255, BLUE);
+    bitmap_clear_rect(&temp, Rect { 0, 0, 256, 256 });
+    CHECK(bitmap_blend_rect(&layer, &temp, 0, 0, Rect { 0, 0, 256, 256 }));
+    for (int i = 0; i < layer.tiles_x * layer.tiles_y; i++) {
+        CHECK(layer.tiles[i] == snapshot.tiles[i]);
+    }
+
+    Bitmap empty = bitmap_create(256, 256);
+    CHECK(bitmap_blend(&layer, &empty, 0, 0));
+    for (int i = 0; i < layer.tiles_x * layer.tiles_y; i++) {
+        CHECK(layer.tiles[i] == snapshot.tiles[i]);
+    }
+    CHECK(color_eq(pixel(&layer, 10, 10), RED));
+
+    bitmap_free(&empty);
+    bitmap_free(&temp);
+    bitmap_free(&snapshot);
+    bitmap_free(&layer);
+}
+
+// Clearing the part of a tile that was drawn on frees it, and keeps tiles
+// with something left in them
+static void test_clear_frees_tiles() {
+    Bitmap bitmap = bitmap_create_tiled(256, 256);
+    bitmap_draw_line(&bitmap, 5, 5, 200, 150, BLUE);
+    bitmap_draw_pixel(&bitmap, 250, 250, RED);
+    bitmap_clear_rect(&bitmap, Rect { 5, 5, 196, 146 });
+    for (int i = 0; i < bitmap.tiles_x * bitmap.tiles_y - 1; i++) {
+        CHECK(bitmap.tiles[i] == NULL);
+    }
+
+    bitmap_clear_rect(&bitmap, Rect { 200, 200, 10, 10 });
+    CHECK(bitmap.tiles[bitmap.tiles_x * bitmap.tiles_y - 1] != NULL);
+    CHECK(color_eq(pixel(&bitmap, 250, 250), RED));
+    bitmap_clear_rect(&bitmap, Rect { 250, 250, 1, 1 });
+    CHECK(bitmap.tiles[bitmap.tiles_x * bitmap.tiles_y - 1] == NULL);
+    bitmap_free(&bitmap);
+}
+
+// A polyline drawn segment by segment blends its joints once, like the rest
+static void test_line_aa_joints() {
+    Bitmap bitmap = bitmap_create_tiled(64, 64);
+    Color color = { 255, 0, 0, 128 };
+    bitmap_draw_line_aa(&bitmap, 5, 5, 5, 5, color, false);
+    bitmap_draw_line_aa(&bitmap, 5, 5, 20, 5, color, true);
+    bitmap_draw_line_aa(&bitmap, 20, 5, 40, 5, color, true);
+    bitmap_draw_line_aa(&bitmap, 40, 5, 40, 5, color, true);
+    CHECK(pixel(&bitmap, 5, 5).a == pixel(&bitmap, 10, 5).a);
+    CHECK(pixel(&bitmap, 20, 5).a == pixel(&bitmap, 10, 5).a);
+    CHECK(pixel(&bitmap, 40, 5).a == pixel(&bitmap, 10, 5).a);
+    bitmap_free(&bitmap);
+}
+
+// Undoing and redoing a change to a large layer, with the history compressed
+static void test_history_large() {
+    Image image = image_create(LARGE_SIZE, LARGE_SIZE, PIXEL_STRAIGHT);
+    image_add_layer(&image, layer_create("layer", 0, 0, LARGE_SIZE, LARGE_SIZE, PIXEL_STRAIGHT));
+    if (image.layers[0].bitmap.width == 0) {
+        printf("Skipping the large history test: not enough memory\n");
+        image_free(image);
+        return;
+    }
+    ImageHistory hist = image_history_create();
+    image_take_snapshot(&image, &hist);
+    int last = LARGE_SIZE - 1;
+    bitmap_fill_rect(&image.layers[0].bitmap, Rect { last - 200, last - 200, 201, 201 }, RED);
+    image_take_snapshot(&image, &hist);
+    image_history_set_budget(&hist, 0);
+
+    CHECK(image_undo(&image, &hist));
+    CHECK(color_eq(pixel(&image.layers[0].bitmap, last, last), TRANSPARENT));
+    CHECK(image_redo(&image, &hist));
+    CHECK(color_eq(pixel(&image.layers[0].bitmap, last, last), RED));
+    CHECK(color_eq(pixel(&image.layers[0].bitmap, last - 201, last), TRANSPARENT));
+
+    image_history_free(&hist);
+    image_free(image);
+}
+
+// Undo and redo refuse steps whose spilled history can't be read back, and
+// leave the image as it was
+static void test_history_damaged() {
+    Image image = image_create(256, 256, PIXEL_STRAIGHT);
+    image_add_layer(&image, layer_create("layer", 0, 0, 256, 256, PIXEL_STRAIGHT));
+    ImageHistory hist = image_history_create();
+    // Drawn over below, so only the entry holds these tiles and they get spilled
+    bitmap_draw_line(&image.layers[0].bitmap, 0, 0, 255, 255, GREEN);
+    image_take_snapshot(&image, &hist);
+    bitmap_fill_rect(&image.layers[0].bitmap, Rect { 0, 0, 100, 100 }, RED);
+    image_take_snapshot(&image, &hist);
+    image_history_set_budget(&hist, 0);
+    HistoryEntry *entry = &hist.entries[0];
+    CHECK(entry->storage == ENTRY_SPILLED);
+
+    // Past the end of the spill file
+    long offset = entry->spill_offset;
+    entry->spill_offset = offset + 1000000;
+    CHECK(!image_undo(&image, &hist));
+    CHECK(hist.idx == 1);
+    CHECK(color_eq(pixel(&image.layers[0].bitmap, 50, 50), RED));
+    entry->spill_offset = offset;
+
+    CHECK(image_undo(&image, &hist));
+    CHECK(color_eq(pixel(&image.layers[0].bitmap, 50, 50), GREEN));
+    CHECK(color_eq(pixel(&image.layers[0].bitmap, 50, 51), TRANSPARENT));
+    CHECK(image_redo(&image, &hist));
+    CHECK(color_eq(pixel(&image.layers[0].bitmap, 50, 50), RED));
+
+    // A blob cut short is read back, but not applied
+    CHECK(entry->storage == ENTRY_SPILLED);
+    entry->compressed_size--;
+    CHECK(!image_undo(&image, &hist));
+    CHECK(hist.idx == 1);
+    CHECK(color_eq(pixel(&image.layers[0].bitmap, 50, 50), RED));
+
+    image_history_free(&hist);
+    image_free(image);
+}
+
+// A canvas the compositor can't allocate is reported, and a later one that
+// fits recovers
+static void test_compositor_out_of_memory() {
+    Compositor *compositor = compositor_create();
+    CHECK(compositor_resize(compositor, 1 << 30, 1 << 30, PIXEL_STRAIGHT));
+    CHECK(compositor_out_of_memory(compositor));
+
+    CHECK(compositor_resize(compositor, 300, 200, PIXEL_STRAIGHT));
+    CHECK(!compositor_out_of_memory(compositor));
+    Layer layer = layer_create("layer", 0, 0, 300, 200, PIXEL_STRAIGHT);
+    bitmap_fill_rect(&layer.bitmap, Rect { 0, 0, 300, 200 }, RED);
+    Layer *layers[] = { &layer };
+    compositor_submit(compositor, layers, 1, 0, 1, Rect { 0, 0, 300, 200 });
+    compositor_finish(compositor);
+    CHECK(color_eq(pixel(compositor_front(compositor), 150, 100), RED));
+    layer_free(&layer);
+    compositor_free(compositor);
+}
+
+static int allocated_tiles(Bitmap *bitmap) {
+    int count = 0;
+    for (int i = 0; i < bitmap->tiles_x * bitmap->tiles_y; i++) {
+        count += bitmap->tiles[i] != NULL;
+    }
+    return count;
+}
+
+// A large canvas only takes tiles where something was composited, and the
+// buffers share the tiles they have in common
+static void test_compositor_sparse() {
+    Compositor *compositor = compositor_create();
+    CHECK(compositor_resize(compositor, LARGE_SIZE, LARGE_SIZE, PIXEL_STRAIGHT));
+    CHECK(!compositor_out_of_memory(compositor));
+    Layer layer = layer_create("layer", 1000, 1000, 128, 128, PIXEL_STRAIGHT);
+    bitmap_fill_rect(&layer.bitmap, Rect { 0, 0, 128, 128 }, GREEN);
+    Layer *layers[] = { &layer };
+    compositor_submit(compositor, layers, 1, 0, 1, Rect { 0, 0, LARGE_SIZE, LARGE_SIZE });
+    compositor_finish(compositor);
+    for (int level = 0; level < compositor_level_count(compositor); level++) {
+        CHECK(allocated_tiles(compositor_front_level(compositor, level)) <= 9);
+    }
+    CHECK(color_eq(pixel(compositor_front(compositor), 1050, 1050), GREEN));
+    CHECK(color_eq(pixel(compositor_front(compositor), 0, 0), TRANSPARENT));
+    CHECK(color_eq(pixel(compositor_front_level(compositor, 2), 1050 / 4, 1050 / 4), GREEN));
+
+    // The second job brings the other buffer up to date before drawing
+    bitmap_draw_pixel(&layer.bitmap, 100, 100, RED);
+    compositor_submit(compositor, layers, 1, 0, 1, Rect { 1100, 1100, 1, 1 });
+    compositor_finish(compositor);
+    CHECK(color_eq(pixel(compositor_front(compositor), 1100, 1100), RED));
+    CHECK(color_eq(pixel(compositor_front(compositor), 1050, 1050), GREEN));
+    // (1000, 1000) is in a cell the second job didn't redraw
+    int index = (1000 >> TILE_SHIFT) * compositor->buffers[0].tiles_x + (1000 >> TILE_SHIFT);
+    CHECK(compositor->buffers[0].tiles[index] != NULL);
+    CHECK(compositor->buffers[0].tiles[index] == compositor->buffers[1].tiles[index]);
+    layer_free(&layer);
+    compositor_free(compositor);
+}
+
+int main() {
+    test_create_too_large();
+    test_large(false);
+    test_large(true);
+    test_blend_keeps_shared_tiles();
+    test_clear_frees_tiles();
+    test_line_aa_joints();
+    test_history_large();
+    test_history_damaged();
+    test_compositor_out_of_memory();
+    test_compositor_sparse();
+    CHECK(!bitmap_take_allocation_failure());
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
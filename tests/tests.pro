@@ -0,0 +1,31 @@
+# Tests for the modules that don't use Qt. Build and run them with
+#   qmake tests.pro && make check
+
+QT -= core gui
+
+CONFIG += console c++11 thread testcase
+CONFIG -= app_bundle
+
+TARGET = tests
+
+INCLUDEPATH += ..
+
+SOURCES += \
+    tests.cpp \
+    ../src/Image.cpp \
+    ../src/History.cpp \
+    ../src/Compress.cpp \
+    ../src/Bitmap.cpp \
+    ../src/Blend.cpp \
+    ../src/Parallel.cpp \
+    ../src/Compositor.cpp
+
+HEADERS += \
+    ../src/Image.h \
+    ../src/History.h \
+    ../src/Compress.h \
+    ../src/Bitmap.h \
+    ../src/Blend.h \
+    ../src/Parallel.h \
+    ../src/Compositor.h \
+    ../src/common.h